@@ -0,0 +1,162 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <iostream>
+#include <algorithm>
+
+#include "amplicon.h"
+
+using namespace std;
+
+// the two bases of the ambiguity codes supported in the anchors (as in Trie::makeTrieFromConfig)
+static bool
+iupacBases(char c, char *a, char *b) {
+  switch (c) {
+  case 'R': *a = 'A'; *b = 'G'; return true;
+  case 'Y': *a = 'C'; *b = 'T'; return true;
+  case 'S': *a = 'G'; *b = 'C'; return true;
+  case 'W': *a = 'A'; *b = 'T'; return true;
+  case 'K': *a = 'G'; *b = 'T'; return true;
+  case 'M': *a = 'A'; *b = 'C'; return true;
+  }
+  return false;
+}
+
+// the number of bases that differ between two words
+#define DIFFERENTBASES(x) ((unsigned) __builtin_popcountll( ((x) | ((x) >> 1)) & 0x5555555555555555ULL ))
+
+
+bool
+AmpliconFinder::build(const vector<Config> &c, unsigned numStrs, unsigned char distance) {
+  this->distance = distance;
+  words.assign(numStrs, vector<Word>());
+  for (unsigned i=0; i < numStrs; ++i) {
+    if (c[i].forwardLength > MAXWORD/2 || c[i].reverseLength > MAXWORD/2)
+      return false;
+    if (c[i].forwardCount != 1 || c[i].reverseCount != 1)
+      continue;
+
+    addWord(i, c[i].forwardFlank, FORWARDFLANK, FORWARDFLANK_RC);
+    addWord(i, c[i].reverseFlank, REVERSEFLANK, REVERSEFLANK_RC);
+  }
+
+  filter.build(c, numStrs, distance, true);
+  return true;
+}
+
+
+void
+AmpliconFinder::addWord(unsigned locus, const string &s, unsigned char type, unsigned char rcType) {
+  unsigned f, j, len = s.length();
+  string forms[2] = {s, s};
+  Word w[2]; // the word, and its reverse complement
+
+  // (as in the trie, only the first ambiguity code is expanded)
+  for (j=0; j < len; ++j) {
+    if (iupacBases(s[j], &forms[0][j], &forms[1][j]))
+      break;
+  }
+
+  w[0].len = w[1].len = len;
+  w[0].pieces = w[1].pieces = AnchorFilter::pieces(len, distance);
+  w[0].id = w[1].id = locus;
+  w[0].type = type;
+  w[1].type = rcType;
+  for (f=0; f < 2; ++f) {
+    binaryword fwd = gatcToLong((char*) forms[f].c_str(), len), rc;
+    reverseComplement(&fwd, &rc, len);
+    w[0].form[f] = fwd >> (MAXWORD - 2*len);
+    w[1].form[f] = rc >> (MAXWORD - 2*len);
+  }
+  words[locus].push_back(w[0]);
+  words[locus].push_back(w[1]);
+}
+
+
+bool
+AmpliconFinder::wordAt(const EncodedRead &read, unsigned pos, const Word &word) const {
+  binaryword w = 0;
+  if (pos + word.len > read.len || nextAmbiguous(read, pos) < pos + word.len)
+    return false;
+  for (unsigned k=pos; k < pos + word.len; ++k)
+    w = (w << 2) | read.codes[k];
+  return min(DIFFERENTBASES(w ^ word.form[0]), DIFFERENTBASES(w ^ word.form[1])) <= distance;
+}
+
+
+// the order of Trie::findAllMatches; by start position, and then by length (and then in the order the loci were added to the trie)
+static bool
+hitOrder(const TrieHit &a, const TrieHit &b) {
+  if (a.pos != b.pos)
+    return a.pos < b.pos;
+  if (a.len != b.len)
+    return a.len < b.len;
+  return a.id < b.id;
+}
+
+
+bool
+AmpliconFinder::findHits(const EncodedRead &read, vector<TrieHit> &hits) const {
+  unsigned q, i, j, n, pos;
+  QgramHit qgrams[AMPLICONQGRAMS];
+
+  hits.clear();
+  if (! filter.findQgrams(read, qgrams, AMPLICONQGRAMS, &n))
+    return false;
+
+  for (q=0; q < n; ++q) {
+    const vector<Word> &anchors = words[ qgrams[q].locus ];
+    if (anchors.empty())
+      return false;
+
+    // each anchor of the locus, wherever the q-gram would be one of its pieces
+    for (j=0; j < anchors.size(); ++j) {
+      const Word &word = anchors[j];
+      for (i=0; i < word.pieces && i * PREFILTERQ <= qgrams[q].pos; ++i) {
+        pos = qgrams[q].pos - i * PREFILTERQ;
+        unsigned h;
+        for (h=0; h < hits.size(); ++h)
+          if (hits[h].pos == pos && hits[h].id == word.id && hits[h].type == word.type)
+            break;
+        if (h == hits.size() && wordAt(read, pos, word)) {
+          TrieHit hit = {pos, word.len, word.id, word.type};
+          hits.push_back(hit);
+        }
+      }
+    }
+  }
+
+  // (there are only a few hits)
+  for (i=1; i < hits.size(); ++i) {
+    TrieHit hit = hits[i];
+    for (j=i; j > 0 && hitOrder(hit, hits[j - 1]); --j)
+      hits[j] = hits[j - 1];
+    // (a tie; see findHits in amplicon.h)
+    if (j > 0 && ! hitOrder(hits[j - 1], hit))
+      return false;
+    hits[j] = hit;
+  }
+  return true;
+}
@@ -0,0 +1,81 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef AMPLICON_H_
+#define AMPLICON_H_
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+#include "constants.h"
+#include "lookup.h"
+#include "trie.h"
+#include "prefilter.h"
+
+// the most q-grams (of the anchors) a read of -e can have; a read with more is left to the trie
+#define AMPLICONQGRAMS 32
+
+/*
+  Amplicon mode (-e)
+  In targeted (amplicon) data, a read has few of the anchors' q-grams (those of its own locus, and the odd chance match).
+  The q-grams of the read are looked up in an AnchorFilter that knows which locus each of them comes from
+  an anchor can only be where one of its pieces is one of these q-grams, so the anchors of that locus are only checked there
+  (within the Hamming distance; the hits are the ones the trie would find). The motifs are then looked for between the anchors (as with -l)
+  so the calls are the same. A read with many such q-grams (or with one from a locus whose anchors appear more than once) is searched in full, by the trie
+ */
+class AmpliconFinder {
+public:
+  // the anchors of the numStrs loci in c, with up to distance substitutions
+  // returns false if an anchor is too long for this (more than MAXWORD/2 bases)
+  bool build(const std::vector<Config> &c, unsigned numStrs, unsigned char distance);
+
+  // writes the anchors in the read (in the order that Trie::findAllMatches gives them) to hits
+  // returns false if the read needs the full search (and hits is then meaningless)
+  // (as when two anchors of a locus are found at the same place; eg, a palindrome and its reverse complement. the trie's order of those depends on how it added their mismatches)
+  bool findHits(const EncodedRead &read, std::vector<TrieHit> &hits) const;
+
+private:
+  // an anchor as it appears in the read (ie, in the orientation of type); the last 2*len bits of the binarywords
+  // with an ambiguity code, the two forms differ at that base (and each is matched on its own, as in the trie)
+  struct Word {
+    binaryword form[2];
+    unsigned len;
+    unsigned pieces; // see AnchorFilter::pieces
+    unsigned id; // the locus
+    unsigned char type;
+  };
+
+  // the anchors of each locus; FORWARDFLANK, FORWARDFLANK_RC, REVERSEFLANK and REVERSEFLANK_RC (the order they're added to the trie)
+  // (empty for a locus that has an anchor that appears more than once; those reads are left to the trie)
+  std::vector< std::vector<Word> > words;
+  unsigned char distance;
+  AnchorFilter filter; // (with the loci of the q-grams)
+
+  void addWord(unsigned locus, const std::string &s, unsigned char type, unsigned char rcType);
+  // whether or not word is in read at pos
+  bool wordAt(const EncodedRead &read, unsigned pos, const Word &word) const;
+};
+
+#endif
@@ -32,7 +32,7 @@ do
         echo "Failed to make directory: $bn\R1"
         exit
     fi  
-    zcat $fq | ./$str8 -c $config -p $numcores > "$bn/R1/allsequences.txt"
+    ./$str8 -c $config -p $numcores $fq > "$bn/R1/allsequences.txt"
 done
 
 
@@ -0,0 +1,261 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <iostream>
+#include <stdlib.h>
+#include <cstring>
+
+#include "haplotypes.h"
+
+using namespace std;
+
+// the initial capacity of a table
+#define HAPTABLEBITS 12
+// the table grows when it's this full (a fraction of 256)
+#define HAPTABLELOAD 160
+// the size of the blocks of memory in an arena
+#define ARENABLOCK (1 << 20)
+
+static inline uint64_t
+mix(uint64_t h, uint64_t w) {
+  h ^= w;
+  h *= 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 29);
+}
+
+uint64_t
+hashReport(const Report &rep) {
+  uint64_t h = mix(0x243F6A8885A308D3ULL, ((uint64_t)rep.strIndex << 32) | ((uint64_t)rep.nonstandardLetters << 31) | (uint32_t)rep.hapLength);
+
+  if (rep.nonstandardLetters == false) {
+    unsigned i, numWords = (rep.hapLength + MAXWORD/2 - 1) / (MAXWORD/2);
+    for (i=0; i < numWords; ++i)
+      h = mix(h, rep.haplotype[i]);
+  } else {
+    const char *s = (const char*) rep.haplotype;
+    int i;
+    uint64_t w;
+    for (i=0; i + 8 <= rep.hapLength; i += 8) {
+      memcpy(&w, s + i, 8);
+      h = mix(h, w);
+    }
+    if (i < rep.hapLength) {
+      w = 0;
+      memcpy(&w, s + i, rep.hapLength - i);
+      h = mix(h, w);
+    }
+  }
+  return h;
+}
+
+bool
+sameReport(const Report &a, const Report &b) {
+  if (a.strIndex != b.strIndex || a.hapLength != b.hapLength || a.nonstandardLetters != b.nonstandardLetters)
+    return false;
+
+  // (the unused bits of the last binaryword are always 0)
+  if (a.nonstandardLetters == false)
+    return memcmp(a.haplotype, b.haplotype, ((a.hapLength + MAXWORD/2 - 1) / (MAXWORD/2)) * sizeof(binaryword)) == 0;
+  return memcmp(a.haplotype, b.haplotype, a.hapLength) == 0;
+}
+
+
+Arena::Arena() {
+  next = NULL;
+  left = 0;
+}
+
+Arena::~Arena() {
+  clear();
+}
+
+void
+Arena::clear() {
+  for (unsigned i=0; i < blocks.size(); ++i)
+    free(blocks[i]);
+  blocks.clear();
+  next = NULL;
+  left = 0;
+}
+
+void *
+Arena::alloc(size_t bytes) {
+  bytes = (bytes + sizeof(binaryword) - 1) & ~(sizeof(binaryword) - 1);
+  if (bytes == 0) // (so that every allocation has its own address)
+    bytes = sizeof(binaryword);
+
+  if (bytes > left) {
+    // big requests get a block of their own (and the current block stays in use)
+    size_t size = bytes > ARENABLOCK / 4 ? bytes : ARENABLOCK;
+    char *block = (char*) malloc(size);
+    if (block == NULL) {
+      cerr << "Failed to allocate memory for the haplotypes" << endl;
+      exit(EXIT_FAILURE);
+    }
+    blocks.push_back(block);
+    if (size != ARENABLOCK)
+      return block;
+    next = block;
+    left = size;
+  }
+
+  void *p = next;
+  next += bytes;
+  left -= bytes;
+  return p;
+}
+
+
+static inline unsigned
+hashShort(unsigned strIndex, int hapLength, binaryword code) {
+  uint64_t h = mix(code, ((uint64_t)strIndex << 8) | (uint64_t)hapLength);
+  return h ^ (h >> 32);
+}
+
+HapTable::HapTable() {
+  table = NULL;
+  shortTable = NULL;
+  mask = shortMask = 0;
+  used = shortUsed = 0;
+  clear();
+}
+
+HapTable::~HapTable() {
+  delete[] table;
+  delete[] shortTable;
+}
+
+void
+HapTable::clear() {
+  unsigned i;
+
+  delete[] table;
+  haplotypes.clear();
+  mask = (1U << HAPTABLEBITS) - 1;
+  used = 0;
+  table = new HapEntry[ mask + 1 ];
+  for (i=0; i <= mask; ++i)
+    table[i].key.hapLength = -1;
+
+  delete[] shortTable;
+  shortMask = (1U << HAPTABLEBITS) - 1;
+  shortUsed = 0;
+  shortTable = new ShortHapEntry[ shortMask + 1 ];
+  for (i=0; i <= shortMask; ++i)
+    shortTable[i].hapLength = -1;
+}
+
+void
+HapTable::grow() {
+  HapEntry *old = table;
+  unsigned i, j, oldCapacity = mask + 1;
+
+  mask = mask * 2 + 1;
+  table = new HapEntry[ mask + 1 ];
+  for (i=0; i <= mask; ++i)
+    table[i].key.hapLength = -1;
+
+  for (i=0; i < oldCapacity; ++i) {
+    if (old[i].key.hapLength < 0)
+      continue;
+    for (j = old[i].hash & mask; table[j].key.hapLength >= 0; j = (j + 1) & mask)
+      ;
+    table[j] = old[i];
+  }
+  delete[] old;
+}
+
+HapCounter &
+HapTable::upsert(const Report &rep) {
+  uint64_t h = hashReport(rep);
+  unsigned i;
+
+  for (i = h & mask; table[i].key.hapLength >= 0; i = (i + 1) & mask) {
+    if (table[i].hash == h && sameReport(table[i].key, rep))
+      return table[i].count;
+  }
+
+  if ((used + 1) * 256ULL > (mask + 1ULL) * HAPTABLELOAD) {
+    grow();
+    for (i = h & mask; table[i].key.hapLength >= 0; i = (i + 1) & mask)
+      ;
+  }
+
+  // a new haplotype; keep a copy of it
+  // (character haplotypes keep their terminating 0)
+  size_t bytes = rep.nonstandardLetters ? rep.hapLength + 1 : ((rep.hapLength + MAXWORD/2 - 1) / (MAXWORD/2)) * sizeof(binaryword);
+  binaryword *hap = (binaryword*) haplotypes.alloc(bytes);
+  memcpy(hap, rep.haplotype, bytes);
+
+  ++used;
+  table[i].key = rep;
+  table[i].key.haplotype = hap;
+  table[i].hash = h;
+  memset(&table[i].count, 0, sizeof(HapCounter));
+  return table[i].count;
+}
+
+void
+HapTable::growShort() {
+  ShortHapEntry *old = shortTable;
+  unsigned i, j, oldCapacity = shortMask + 1;
+
+  shortMask = shortMask * 2 + 1;
+  shortTable = new ShortHapEntry[ shortMask + 1 ];
+  for (i=0; i <= shortMask; ++i)
+    shortTable[i].hapLength = -1;
+
+  for (i=0; i < oldCapacity; ++i) {
+    if (old[i].hapLength < 0)
+      continue;
+    for (j = hashShort(old[i].strIndex, old[i].hapLength, old[i].code) & shortMask; shortTable[j].hapLength >= 0; j = (j + 1) & shortMask)
+      ;
+    shortTable[j] = old[i];
+  }
+  delete[] old;
+}
+
+HapCounter &
+HapTable::upsertShort(unsigned strIndex, int hapLength, binaryword code) {
+  unsigned i, h = hashShort(strIndex, hapLength, code);
+
+  for (i = h & shortMask; shortTable[i].hapLength >= 0; i = (i + 1) & shortMask) {
+    if (shortTable[i].code == code && shortTable[i].strIndex == strIndex && shortTable[i].hapLength == hapLength)
+      return shortTable[i].count;
+  }
+
+  if ((shortUsed + 1) * 256ULL > (shortMask + 1ULL) * HAPTABLELOAD) {
+    growShort();
+    for (i = h & shortMask; shortTable[i].hapLength >= 0; i = (i + 1) & shortMask)
+      ;
+  }
+
+  ++shortUsed;
+  shortTable[i].code = code;
+  shortTable[i].strIndex = strIndex;
+  shortTable[i].hapLength = hapLength;
+  memset(&shortTable[i].count, 0, sizeof(HapCounter));
+  return shortTable[i].count;
+}
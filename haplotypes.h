@@ -0,0 +1,190 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef HAPLOTYPES_H_
+#define HAPLOTYPES_H_
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "constants.h"
+
+// the anatomy of what we keep for a haplotype
+struct Report {
+  unsigned strIndex; // which haplotype
+  binaryword *haplotype; // unique sequence between the flanks
+  bool nonstandardLetters; // are there nonstandard letters (outside of ste GATC)? If so, then binaryword is actually a char*
+  int hapLength; // the length of *haplotype in CHARACTERS (ie, in the set {GATC}). ie, the number of bits*2 used in *haplotype
+};
+
+struct CompareReport {
+
+  bool operator() (const Report &a, const Report &b) const {
+    //TODO: Handle string/float pair instead of lexicographic ordering
+
+    unsigned i1 = a.strIndex;
+    unsigned i2 = b.strIndex;
+
+    // different loci
+    if (i2 < i1) 
+      return false;
+    else if (i1 < i2) 
+      return true;
+
+
+    // different haplotype lengths; ergo different haplotypes
+    if (a.hapLength < b.hapLength)
+      return true;
+    else if (a.hapLength > b.hapLength)
+      return false;
+
+    // one haplotype has nonstandard letters and the other does not.    
+    if (a.nonstandardLetters == false && b.nonstandardLetters==true)
+      return false;
+    else if (a.nonstandardLetters == true && b.nonstandardLetters==false)
+      return true;
+
+    if (a.nonstandardLetters==false) { // compare binary words
+
+    // compute the (min) length in binarywords of the two haplotypes
+      unsigned i, lengthInWords = ceil( std::min(a.hapLength, b.hapLength)/ (MAXWORD/2.0));
+      binaryword *b1 = a.haplotype;
+      binaryword *b2 = b.haplotype;
+      
+      for (i=0; i < lengthInWords; ++i, ++b1, ++b2) {
+        if (*b1 < *b2)
+          return true;
+        else if (*b1 > *b2)
+          return false;
+      }
+
+    } else { // compare char*s
+      char *b1 = (char*) a.haplotype;
+      char *b2 = (char*) b.haplotype;
+
+      for (int i=0; i < a.hapLength; ++i, ++b1, ++b2) {
+        if (*b1 < *b2)
+          return true;
+        else if (*b1 > *b2)
+          return false;
+      }
+    }
+
+    return false;
+    
+  }
+
+};
+
+// first and second names are bad, but they let me very easily extend from a std::pair to this bad boy
+struct HapCounter {
+  unsigned first; // count of haplotype on forward strand
+  unsigned second; // and reverse
+  double fq;  // ditto for quality sums
+  double rq;
+};
+
+// a bump allocator; what it hands out is only freed when the arena is cleared (or destroyed)
+class Arena {
+ public:
+  Arena();
+  ~Arena();
+
+  // returns bytes bytes of memory (aligned for a binaryword)
+  void *alloc(size_t bytes);
+  void clear();
+
+ protected:
+  std::vector<char*> blocks;
+  char *next; // the unused part of the last block
+  size_t left; // and how big it is
+};
+
+// a haplotype and its counts
+struct HapEntry {
+  Report key; // key.hapLength < 0 marks an unused entry
+  HapCounter count;
+  uint64_t hash; // the hash of the key (saves comparing haplotypes, and rehashing when the table grows)
+};
+
+// a haplotype that fits in a single binaryword (at most 32 bases, and only ACGT), and its counts
+// the key is stored inline (no pointers)
+struct ShortHapEntry {
+  binaryword code; // the haplotype (the unused bits are 0)
+  unsigned strIndex;
+  int hapLength; // < 0 marks an unused entry
+  HapCounter count;
+};
+
+/*
+  The haplotypes (and their counts) found by a thread
+  A hash table (open addressing, linear probing) keyed on the (locus, haplotype)
+  Haplotypes are interned; the first time a haplotype is seen it is copied into the table's arena
+  (so the caller's haplotype can live on the stack, and memory grows with the number of distinct haplotypes)
+  Short haplotypes (one binaryword; eg, SNPs) are kept in a second, flat table; see upsertShort
+*/
+class HapTable {
+ public:
+  HapTable();
+  ~HapTable();
+
+  // returns the counts of the haplotype rep. if the haplotype isn't in the table, it is added (w/ counts of 0)
+  HapCounter &upsert(const Report &rep);
+  // the same, for a haplotype of (at most) one binaryword (with no nonstandard letters)
+  HapCounter &upsertShort(unsigned strIndex, int hapLength, binaryword code);
+
+  // the number of haplotypes in the table
+  unsigned size() { return used + shortUsed; }
+
+  // the table itself; entries in [0, capacity()) that are not in use have key.hapLength < 0
+  unsigned capacity() { return mask + 1; }
+  HapEntry &entry(unsigned i) { return table[i]; }
+  // and the table of short haplotypes (likewise)
+  unsigned shortCapacity() { return shortMask + 1; }
+  ShortHapEntry &shortEntry(unsigned i) { return shortTable[i]; }
+
+  void clear();
+
+ protected:
+  void grow();
+  void growShort();
+
+  HapEntry *table;
+  unsigned mask; // the capacity (a power of 2) - 1
+  unsigned used;
+  Arena haplotypes; // the (interned) haplotypes of the keys
+
+  ShortHapEntry *shortTable;
+  unsigned shortMask;
+  unsigned shortUsed;
+};
+
+// the hash used by the HapTable
+uint64_t hashReport(const Report &rep);
+// whether or not two reports are for the same haplotype (of the same locus)
+bool sameReport(const Report &a, const Report &b);
+
+#endif
@@ -0,0 +1,278 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "constants.h"
+#include "trie.h"
+#include "index.h"
+
+using namespace std;
+
+/*
+  The layout of an index file:
+  IndexHeader
+  the config (numStrs loci; see appendConfig)
+  (padding)
+  the trie nodes (numNodes TrieNodes)
+  the match pool (numMatches TrieMatches)
+  Everything is in the native byte order; the sizes of the structs are recorded, and checked when the index is loaded
+*/
+
+#define INDEXMAGIC "STR8IDX"
+#define INDEXVERSION 2
+// the nodes start on a cache-line boundary
+#define INDEXALIGN 64
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t nodeSize; // sizeof(TrieNode)
+  uint32_t matchSize; // sizeof(TrieMatch)
+  uint32_t numStrs;
+  uint32_t numNodes;
+  uint32_t numMatches;
+  uint64_t configOffset; // offsets are in bytes, from the start of the file
+  uint64_t configBytes;
+  uint64_t nodeOffset;
+  uint64_t matchOffset;
+  IndexSettings settings;
+};
+
+
+// helpers to (de)serialize the config
+static void
+appendBytes(string &buf, const void *p, size_t n) {
+  buf.append((const char*)p, n);
+}
+
+static void
+appendString(string &buf, const string &s) {
+  uint32_t len = s.length();
+  appendBytes(buf, &len, sizeof(len));
+  buf.append(s);
+}
+
+// a cursor over the config in the index
+struct ConfigReader {
+  const char *p;
+  const char *end;
+
+  bool read(void *out, size_t n) {
+    if ((size_t)(end - p) < n)
+      return false;
+    memcpy(out, p, n);
+    p += n;
+    return true;
+  }
+
+  bool readString(string &s) {
+    uint32_t len;
+    if (! read(&len, sizeof(len)) || (size_t)(end - p) < len)
+      return false;
+    s.assign(p, len);
+    p += len;
+    return true;
+  }
+};
+
+static void
+appendConfig(string &buf, const Config &conf) {
+  appendString(buf, conf.locusName);
+  appendString(buf, conf.markerType);
+  appendString(buf, conf.forwardFlank);
+  appendString(buf, conf.reverseFlank);
+  appendString(buf, conf.strMotif);
+  appendBytes(buf, &conf.forwardLength, sizeof(conf.forwardLength));
+  appendBytes(buf, &conf.reverseLength, sizeof(conf.reverseLength));
+  appendBytes(buf, &conf.motifLength, sizeof(conf.motifLength));
+  appendBytes(buf, &conf.motifPeriod, sizeof(conf.motifPeriod));
+  appendBytes(buf, &conf.motifOffset, sizeof(conf.motifOffset));
+  appendBytes(buf, &conf.forwardCount, sizeof(conf.forwardCount));
+  appendBytes(buf, &conf.reverseCount, sizeof(conf.reverseCount));
+}
+
+static bool
+readConfig(ConfigReader &in, Config &conf) {
+  return in.readString(conf.locusName) &&
+    in.readString(conf.markerType) &&
+    in.readString(conf.forwardFlank) &&
+    in.readString(conf.reverseFlank) &&
+    in.readString(conf.strMotif) &&
+    in.read(&conf.forwardLength, sizeof(conf.forwardLength)) &&
+    in.read(&conf.reverseLength, sizeof(conf.reverseLength)) &&
+    in.read(&conf.motifLength, sizeof(conf.motifLength)) &&
+    in.read(&conf.motifPeriod, sizeof(conf.motifPeriod)) &&
+    in.read(&conf.motifOffset, sizeof(conf.motifOffset)) &&
+    in.read(&conf.forwardCount, sizeof(conf.forwardCount)) &&
+    in.read(&conf.reverseCount, sizeof(conf.reverseCount));
+}
+
+
+bool
+isIndexFile(const char *file) {
+  char magic[8];
+
+  FILE *f = fopen(file, "rb");
+  if (f == NULL)
+    return false;
+
+  bool ret = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+    memcmp(magic, INDEXMAGIC, sizeof(magic)) == 0;
+
+  fclose(f);
+  return ret;
+}
+
+
+bool
+writeIndex(const char *file, vector<Config> *c, unsigned numStrs, Trie *trie, IndexSettings settings) {
+
+  unsigned i;
+  string conf;
+  IndexHeader h;
+  char pad[INDEXALIGN];
+
+  for (i=0; i < numStrs; ++i)
+    appendConfig(conf, (*c)[i]);
+
+  memset(&h, 0, sizeof(h));
+  memset(pad, 0, sizeof(pad));
+  memcpy(h.magic, INDEXMAGIC, sizeof(h.magic));
+  h.version = INDEXVERSION;
+  h.nodeSize = sizeof(TrieNode);
+  h.matchSize = sizeof(TrieMatch);
+  h.numStrs = numStrs;
+  h.numNodes = trie->nodesUsed() + 1;
+  h.numMatches = trie->matchesUsed();
+  h.configOffset = sizeof(h);
+  h.configBytes = conf.length();
+  h.nodeOffset = ((h.configOffset + h.configBytes + INDEXALIGN - 1) / INDEXALIGN) * INDEXALIGN;
+  h.matchOffset = h.nodeOffset + (uint64_t)h.numNodes * sizeof(TrieNode);
+  h.settings = settings;
+
+  FILE *f = fopen(file, "wb");
+  if (f == NULL)
+    return false;
+
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+    fwrite(conf.data(), 1, conf.length(), f) == conf.length() &&
+    fwrite(pad, 1, h.nodeOffset - h.configOffset - h.configBytes, f) == h.nodeOffset - h.configOffset - h.configBytes &&
+    fwrite(trie->nodeArray(), sizeof(TrieNode), h.numNodes, f) == h.numNodes &&
+    fwrite(trie->matchArray(), sizeof(TrieMatch), h.numMatches, f) == h.numMatches;
+
+  if (fclose(f))
+    ok = false;
+
+  return ok;
+}
+
+
+vector<Config>*
+loadIndex(const char *file, unsigned *numStrs, Trie *trie, IndexSettings *settings) {
+
+  unsigned i;
+  struct stat st;
+
+  int fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) {
+    cerr << "Failed to open " << file << " for reading" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  size_t size = st.st_size;
+  if (size < sizeof(IndexHeader)) {
+    cerr << file << " is not a valid index (it's too small)" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+#ifndef _WIN32
+  // read-only and shared; concurrent processes that use the same index share the page cache
+  const char *base = (const char*) mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    cerr << "Failed to map " << file << " into memory" << endl;
+    exit(EXIT_FAILURE);
+  }
+#else
+  // no mmap; read the whole thing in.
+  char *base = (char*) malloc(size);
+  size_t got = 0;
+  ssize_t n;
+  while (got < size && (n = read(fd, base + got, size - got)) > 0)
+    got += n;
+  if (got != size) {
+    cerr << "Failed to read " << file << endl;
+    exit(EXIT_FAILURE);
+  }
+#endif
+  close(fd);
+
+  IndexHeader h;
+  memcpy(&h, base, sizeof(h));
+  if (memcmp(h.magic, INDEXMAGIC, sizeof(h.magic)) || h.version != INDEXVERSION ||
+      h.nodeSize != sizeof(TrieNode) || h.matchSize != sizeof(TrieMatch)) {
+    cerr << file << " is not an index that this version of the program can use. Please rebuild it with --build-index" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (h.configOffset + h.configBytes > size || h.nodeOffset % INDEXALIGN ||
+      h.matchOffset != h.nodeOffset + (uint64_t)h.numNodes * sizeof(TrieNode) ||
+      h.matchOffset + (uint64_t)h.numMatches * sizeof(TrieMatch) > size ||
+      h.numNodes == 0 || h.numMatches == 0) {
+    cerr << file << " is not a valid index (it's truncated?)" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  vector<Config> *c = new vector<Config>(h.numStrs);
+  ConfigReader in;
+  in.p = base + h.configOffset;
+  in.end = in.p + h.configBytes;
+  for (i=0; i < h.numStrs; ++i) {
+    if (! readConfig(in, (*c)[i])) {
+      cerr << file << " is not a valid index (bad config)" << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  trie->attach( (const TrieNode*) (base + h.nodeOffset), h.numNodes,
+                (const TrieMatch*) (base + h.matchOffset) );
+
+  *numStrs = h.numStrs;
+  *settings = h.settings;
+  return c;
+}
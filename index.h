@@ -0,0 +1,57 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "constants.h"
+#include "trie.h"
+
+// A precompiled index is the (parsed) config file plus the trie that was built from it
+// the trie is stored exactly as it is in memory (nodes refer to each other by index)
+// so the index can be memory-mapped (read-only) and used as is; processes that use the same index share its pages
+
+// settings that the trie was built with
+struct IndexSettings {
+  unsigned char distance; // -a
+  unsigned char motifDistance; // -m
+  unsigned char lazyMotifs; // -l (the trie has no motifs). 0 in the indexes made before -l (the header was zero-filled)
+};
+
+// returns true if file is a precompiled index (ie, made with --build-index) and not a config file
+bool isIndexFile(const char *file);
+
+// writes the config (numStrs loci) and the trie built from it to file
+// returns false if the file cannot be written
+bool writeIndex(const char *file, vector<Config> *c, unsigned numStrs, Trie *trie, IndexSettings settings);
+
+// maps an index into memory, and makes the trie use it
+// returns the config (and sets numStrs, and the settings the trie was built with)
+// this exits if the index is not valid
+vector<Config>* loadIndex(const char *file, unsigned *numStrs, Trie *trie, IndexSettings *settings);
+
+#endif
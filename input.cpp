@@ -0,0 +1,770 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "input.h"
+
+using namespace std;
+
+bool
+isGzipFile(const char *file) {
+  unsigned char magic[2];
+
+  FILE *f = fopen(file, "rb");
+  if (f == NULL)
+    return false;
+
+  bool ret = fread(magic, 1, 2, f) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+  fclose(f);
+  return ret;
+}
+
+#ifndef NOZLIB
+
+// the states of a slot
+#define GZ_EMPTY 0 // free to be (re)filled
+#define GZ_FILLED 1 // (BGZF) has compressed blocks that need inflating
+#define GZ_INFLATING 2 // (BGZF) claimed by an inflater
+#define GZ_READY 3 // has inflated data
+
+// the size of the (compressed) reads from a plain gzip file
+#define GZINBUF (1 << 18)
+
+// a BGZF block starts with a gzip header with the extra field set (FLG.FEXTRA)
+// and the extra field has a BC subfield with the size of the block
+#define BGZFHEADER 18
+#define BGZFMAXBLOCK 65536
+
+static unsigned
+getShort(const unsigned char *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned
+getInt(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+// if the header is that of a BGZF block, returns the size of the block (0 otherwise)
+static unsigned
+bgzfBlockSize(const unsigned char *h) {
+  if (h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || (h[3] & 4) == 0)
+    return 0;
+  if (getShort(h + 10) != 6 || h[12] != 'B' || h[13] != 'C' || getShort(h + 14) != 2)
+    return 0;
+  return getShort(h + 16) + 1;
+}
+
+static void
+gzipError(const char *what) {
+  cerr << "Error decompressing the input (" << what << "); is the file truncated or corrupt?" << endl;
+  exit(EXIT_FAILURE);
+}
+
+
+GzipStreamBuf::GzipStreamBuf(const char *file, int numThreads) {
+  unsigned char h[BGZFHEADER];
+
+  started = false;
+  streamDone = false;
+  consumed = 0;
+  bgzf = false;
+  memset(&strm, 0, sizeof(strm));
+  setg(NULL, NULL, NULL);
+
+  f = fopen(file, "rb");
+  if (f == NULL)
+    return;
+
+  // sniff the first block
+  if (fread(h, 1, BGZFHEADER, f) == BGZFHEADER && bgzfBlockSize(h) >= BGZFHEADER)
+    bgzf = true;
+  rewind(f);
+
+  if (! bgzf) {
+    inbuf.resize(GZINBUF);
+    // 15+32 == a zlib or gzip header (detected automatically)
+    if (inflateInit2(&strm, 15 + 32) != Z_OK)
+      gzipError("inflateInit");
+  }
+
+  if (numThreads < 1)
+    numThreads = 1;
+
+#ifndef NOTHREADS
+  // two pieces per inflater, so that the inflaters are not left waiting on the reader
+  slots.resize( bgzf ? numThreads * 2 + 2 : 4);
+  nextToInflate = 0;
+  stopping = false;
+  threaded = false;
+
+  if (pthread_mutex_init(&lock, NULL) || pthread_cond_init(&changed, NULL))
+    gzipError("failed to init the locks");
+#else
+  slots.resize(1);
+#endif
+
+  for (unsigned i=0; i < slots.size(); ++i) {
+    slots[i].state = GZ_EMPTY;
+    slots[i].outLen = 0;
+    slots[i].last = false;
+  }
+
+#ifndef NOTHREADS
+  if (pthread_create(&reader, NULL, readerMain, this))
+    gzipError("failed to create the reader thread");
+
+  if (bgzf) {
+    inflaters.resize(numThreads);
+    for (int i=0; i < numThreads; ++i) {
+      if (pthread_create(&inflaters[i], NULL, inflaterMain, this))
+        gzipError("failed to create an inflater thread");
+    }
+  }
+  threaded = true;
+#endif
+}
+
+GzipStreamBuf::~GzipStreamBuf() {
+#ifndef NOTHREADS
+  stopThreads();
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&changed);
+#endif
+
+  if (! bgzf && f != NULL)
+    inflateEnd(&strm);
+
+  if (f != NULL)
+    fclose(f);
+}
+
+
+void
+GzipStreamBuf::inflateStream(GzSlot &s) {
+  s.out.resize(GZCHUNK);
+  s.outLen = 0;
+  s.error.clear();
+
+  strm.next_out = (Bytef*) &s.out[0];
+  strm.avail_out = GZCHUNK;
+
+  while (strm.avail_out && ! streamDone) {
+    if (strm.avail_in == 0) {
+      strm.avail_in = fread(&inbuf[0], 1, GZINBUF, f);
+      strm.next_in = &inbuf[0];
+      if (strm.avail_in == 0) {
+        if (ferror(f))
+          s.error = "read error";
+        // EOF in the middle of a member
+        else if (strm.total_in)
+          s.error = "unexpected end of file";
+        streamDone = true;
+        break;
+      }
+    }
+
+    int ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      // gzip files can be concatenated; keep going if there's another member
+      if (strm.avail_in == 0) {
+        strm.avail_in = fread(&inbuf[0], 1, GZINBUF, f);
+        strm.next_in = &inbuf[0];
+      }
+      if (strm.avail_in == 0)
+        streamDone = true;
+      else if (inflateReset(&strm) != Z_OK) {
+        s.error = "inflateReset";
+        streamDone = true;
+      }
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      s.error = strm.msg != NULL ? strm.msg : "inflate";
+      streamDone = true;
+    }
+  }
+
+  s.outLen = GZCHUNK - strm.avail_out;
+  s.last = streamDone;
+}
+
+
+void
+GzipStreamBuf::readBlocks(GzSlot &s) {
+  unsigned char h[BGZFHEADER];
+
+  s.in.clear();
+  s.blockStarts.clear();
+  s.last = false;
+  s.error.clear();
+
+  while (s.blockStarts.size() < BGZFBLOCKS) {
+    size_t n = fread(h, 1, BGZFHEADER, f);
+    if (n == 0) {
+      s.last = true;
+      break;
+    }
+
+    unsigned size = n == BGZFHEADER ? bgzfBlockSize(h) : 0;
+    if (size < BGZFHEADER + 8) {
+      s.error = "not a BGZF block";
+      s.last = true;
+      break;
+    }
+
+    unsigned start = s.in.size();
+    s.blockStarts.push_back(start);
+    s.in.resize(start + size);
+    memcpy(&s.in[start], h, BGZFHEADER);
+    if (fread(&s.in[start + BGZFHEADER], 1, size - BGZFHEADER, f) != size - BGZFHEADER) {
+      s.error = "unexpected end of file";
+      s.last = true;
+      break;
+    }
+  }
+}
+
+void
+GzipStreamBuf::inflateBlocks(GzSlot &s) {
+  unsigned i, outLen = 0;
+  z_stream z;
+
+  s.out.resize(s.blockStarts.size() * BGZFMAXBLOCK);
+
+  s.outLen = 0;
+  // (the blocks couldn't be read)
+  if (! s.error.empty())
+    return;
+
+  memset(&z, 0, sizeof(z));
+  // raw deflate; the gzip header/footer of each block is handled here
+  if (inflateInit2(&z, -15) != Z_OK) {
+    s.error = "inflateInit";
+    return;
+  }
+
+  for (i=0; i < s.blockStarts.size() && s.error.empty(); ++i) {
+    unsigned start = s.blockStarts[i];
+    unsigned end = i + 1 < s.blockStarts.size() ? s.blockStarts[i+1] : s.in.size();
+    // the footer is the CRC32 and the inflated size of the block
+    unsigned isize = getInt(&s.in[end - 4]);
+    if (isize > BGZFMAXBLOCK) {
+      s.error = "BGZF block is too big";
+      break;
+    }
+
+    z.next_in = &s.in[start + BGZFHEADER];
+    z.avail_in = end - start - BGZFHEADER - 8;
+    z.next_out = (Bytef*) &s.out[outLen];
+    z.avail_out = isize;
+
+    int ret = inflate(&z, Z_FINISH);
+    if ((ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && isize == 0)) || z.avail_out != 0)
+      s.error = z.msg != NULL ? z.msg : "inflate";
+    else if (crc32(crc32(0L, Z_NULL, 0), (Bytef*) &s.out[outLen], isize) != getInt(&s.in[end - 8]))
+      s.error = "CRC mismatch";
+
+    outLen += isize;
+    inflateReset(&z);
+  }
+  inflateEnd(&z);
+
+  s.outLen = outLen;
+}
+
+
+int
+GzipStreamBuf::underflow() {
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+
+  if (f == NULL)
+    return traits_type::eof();
+
+  // the piece we just finished with (if any) can be reused
+#ifndef NOTHREADS
+  GzSlot *s;
+  while (1) {
+    pthread_mutex_lock(&lock);
+    if (started) {
+      slots[consumed % slots.size()].state = GZ_EMPTY;
+      if (slots[consumed % slots.size()].last) {
+        pthread_mutex_unlock(&lock);
+        setg(NULL, NULL, NULL);
+        return traits_type::eof();
+      }
+      ++consumed;
+      pthread_cond_broadcast(&changed);
+    }
+    started = true;
+
+    s = &slots[consumed % slots.size()];
+    while (s->state != GZ_READY)
+      pthread_cond_wait(&changed, &lock);
+    pthread_mutex_unlock(&lock);
+
+    // the threads have stopped at the failed piece; it's reported here (and not on those threads)
+    if (! s->error.empty())
+      gzipError(s->error.c_str());
+
+    if (s->outLen) // (an empty piece is possible; eg, the BGZF EOF block)
+      break;
+    if (s->last) {
+      setg(NULL, NULL, NULL);
+      return traits_type::eof();
+    }
+  }
+#else
+  GzSlot *s = &slots[0];
+  do {
+    if (started && s->last) {
+      setg(NULL, NULL, NULL);
+      return traits_type::eof();
+    }
+    started = true;
+    if (bgzf) {
+      readBlocks(*s);
+      inflateBlocks(*s);
+    } else
+      inflateStream(*s);
+    if (! s->error.empty())
+      gzipError(s->error.c_str());
+  } while (s->outLen == 0);
+#endif
+
+  setg(&s->out[0], &s->out[0], &s->out[0] + s->outLen);
+  return traits_type::to_int_type(*gptr());
+}
+
+
+#ifndef NOTHREADS
+
+// reads the file, one piece at a time (and inflates it too, if it's plain gzip)
+void *
+GzipStreamBuf::readerMain(void *arg) {
+  GzipStreamBuf *b = (GzipStreamBuf*) arg;
+  unsigned long i;
+
+  for (i=0 ; ; ++i) {
+    GzSlot &s = b->slots[i % b->slots.size()];
+
+    pthread_mutex_lock(&b->lock);
+    while (s.state != GZ_EMPTY && ! b->stopping)
+      pthread_cond_wait(&b->changed, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+    if (b->stopping)
+      break;
+
+    if (b->bgzf)
+      b->readBlocks(s);
+    else
+      b->inflateStream(s);
+
+    pthread_mutex_lock(&b->lock);
+    s.state = b->bgzf ? GZ_FILLED : GZ_READY;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+
+    if (s.last)
+      break;
+  }
+  return NULL;
+}
+
+// (BGZF) claims the pieces in order, and inflates them
+void *
+GzipStreamBuf::inflaterMain(void *arg) {
+  GzipStreamBuf *b = (GzipStreamBuf*) arg;
+
+  while (1) {
+    pthread_mutex_lock(&b->lock);
+    GzSlot *s = &b->slots[b->nextToInflate % b->slots.size()];
+    while (s->state != GZ_FILLED && ! b->stopping) {
+      pthread_cond_wait(&b->changed, &b->lock);
+      s = &b->slots[b->nextToInflate % b->slots.size()];
+    }
+    if (b->stopping) {
+      pthread_mutex_unlock(&b->lock);
+      break;
+    }
+    s->state = GZ_INFLATING;
+    ++b->nextToInflate;
+    bool last = s->last;
+    // the other inflaters need not wait on this piece
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+
+    b->inflateBlocks(*s);
+
+    pthread_mutex_lock(&b->lock);
+    s->state = GZ_READY;
+    if (last || ! s->error.empty()) // nothing more to inflate; wake up the other inflaters so they exit too
+      b->stopping = true;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+  }
+  return NULL;
+}
+
+void
+GzipStreamBuf::stopThreads() {
+  if (! threaded)
+    return;
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(reader, NULL);
+  for (unsigned i=0; i < inflaters.size(); ++i)
+    pthread_join(inflaters[i], NULL);
+  threaded = false;
+}
+
+#endif
+
+#endif
+
+
+// the size of the reads from a stream
+#define READCHUNK (1 << 20)
+// returned by parseRecord if a record is incomplete
+#define NOPOS ((size_t)-1)
+
+// returns a pointer to the next newline in [p, end) (or NULL if there isn't one)
+static inline char *
+findNewline(char *p, char *end) {
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for ( ; p + 16 <= end; p += 16) {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  return (char*) memchr(p, '\n', end - p);
+}
+
+/*
+  Parses the record that starts at data[pos] (the data end at data[len])
+  returns the offset of the next record, or NOPOS if the record is incomplete (and more data are coming; !atEnd)
+  at the end of the data, a missing line is treated as an empty line (as getline would)
+*/
+static size_t
+parseRecord(char *data, size_t pos, size_t len, bool atEnd, FastqRecord &r) {
+  size_t start[4], stop[4];
+
+  for (int k=0; k < 4; ++k) {
+    if (pos >= len) {
+      if (! atEnd)
+        return NOPOS;
+      start[k] = stop[k] = len;
+      continue;
+    }
+    char *nl = findNewline(data + pos, data + len);
+    if (nl == NULL) {
+      if (! atEnd)
+        return NOPOS;
+      start[k] = pos;
+      stop[k] = pos = len;
+    } else {
+      start[k] = pos;
+      stop[k] = nl - data;
+      pos = stop[k] + 1;
+    }
+  }
+
+  r.seq = start[1];
+  r.seqLen = stop[1] - start[1];
+  r.qual = start[3];
+  r.qualLen = stop[3] - start[3];
+  return pos;
+}
+
+
+FastqBatch::FastqBatch() {
+  base = buf = NULL;
+  numRecs = 0;
+  bufLen = bufCap = 0;
+  codesLen = masksLen = 0;
+}
+
+void
+FastqBatch::encode(FastqRecord &r) {
+  size_t numWords = AMBIGUOUSWORDS(r.seqLen);
+
+  // (+1; so that there is an element to point to, even for an empty read)
+  if (codes.size() < codesLen + r.seqLen + 1)
+    codes.resize(max(codes.size() * 2, codesLen + r.seqLen + 1));
+  if (masks.size() < masksLen + numWords + 1)
+    masks.resize(max(masks.size() * 2, masksLen + numWords + 1));
+
+  r.code = codesLen;
+  r.mask = masksLen;
+  r.valid = encodeRead(base + r.seq, r.seqLen, &codes[codesLen], &masks[masksLen]);
+  codesLen += r.seqLen;
+  masksLen += numWords;
+}
+
+FastqBatch::~FastqBatch() {
+  free(buf);
+}
+
+
+FastqReader::FastqReader()
+#ifndef NOZLIB
+  : gzin(NULL)
+#endif
+{
+  map = NULL;
+  mapLen = mapPos = 0;
+  in = NULL;
+#ifndef NOZLIB
+  gz = NULL;
+#endif
+  eof = false;
+}
+
+FastqReader::~FastqReader() {
+  close();
+}
+
+bool
+FastqReader::mapFile(int fd) {
+#ifndef _WIN32
+  struct stat st;
+  if (fstat(fd, &st) || ! S_ISREG(st.st_mode))
+    return false;
+
+  mapLen = st.st_size;
+  mapPos = 0;
+  if (mapLen == 0) { // nothing to map (and nothing to read)
+    map = NULL;
+    return true;
+  }
+  // private and writable, so that sequences can be upper-cased in place (only pages that are changed are copied)
+  map = (char*) mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    return false;
+  }
+  madvise(map, mapLen, MADV_SEQUENTIAL);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool
+FastqReader::open(const char *fname, int numThreads) {
+  close();
+
+#ifndef NOZLIB
+  if (isGzipFile(fname)) { // gzip (or BGZF); decompressed by other threads
+    gz = new GzipStreamBuf(fname, numThreads);
+    if (! gz->is_open()) {
+      delete gz;
+      gz = NULL;
+      return false;
+    }
+    gzin.rdbuf(gz);
+    in = &gzin;
+    return true;
+  }
+#endif
+
+  int fd = ::open(fname, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) || S_ISDIR(st.st_mode)) { // (reading a directory throws)
+    ::close(fd);
+    return false;
+  }
+  bool mapped = mapFile(fd);
+  ::close(fd);
+  if (mapped)
+    return true;
+
+  // not a regular file (or no mmap); read it like a stream
+  file.open(fname, ios::in | ios::binary);
+  if (! file.is_open())
+    return false;
+  in = &file;
+  return true;
+}
+
+void
+FastqReader::openStdin() {
+  close();
+  if (! mapFile(0))
+    in = &cin;
+}
+
+void
+FastqReader::close() {
+#ifndef _WIN32
+  if (map != NULL)
+    munmap(map, mapLen);
+#endif
+  map = NULL;
+  mapLen = mapPos = 0;
+
+  if (file.is_open())
+    file.close();
+  file.clear();
+#ifndef NOZLIB
+  gzin.rdbuf(NULL);
+  delete gz;
+  gz = NULL;
+#endif
+  in = NULL;
+  carry.clear();
+  eof = false;
+}
+
+bool
+FastqReader::fill(FastqBatch &b, unsigned maxRecs) {
+  if (b.recs.size() < maxRecs)
+    b.recs.resize(maxRecs);
+
+  if (in == NULL)
+    return fillMapped(b, maxRecs);
+  return fillStream(b, maxRecs);
+}
+
+bool
+FastqReader::fillMapped(FastqBatch &b, unsigned maxRecs) {
+  unsigned n;
+
+  b.base = map;
+  b.codesLen = b.masksLen = 0;
+  for (n=0; n < maxRecs && mapPos < mapLen; ++n) {
+    mapPos = parseRecord(map, mapPos, mapLen, true, b.recs[n]);
+    b.encode(b.recs[n]);
+  }
+
+  b.numRecs = n;
+  return mapPos >= mapLen;
+}
+
+// makes room for n more bytes in the batch's buffer
+static void
+growBuffer(FastqBatch &b, size_t n) {
+  if (b.bufLen + n <= b.bufCap)
+    return;
+
+  b.bufCap = b.bufCap ? b.bufCap * 2 : READCHUNK;
+  if (b.bufCap < b.bufLen + n)
+    b.bufCap = b.bufLen + n;
+  b.buf = (char*) realloc(b.buf, b.bufCap);
+  if (b.buf == NULL) {
+    cerr << "Failed to allocate memory for the fastq records" << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// reads up to n bytes from in; the stream buffer throws on a read error (eg, standard input is a directory), which is taken as the end of the file
+static size_t
+readBytes(istream *in, char *s, size_t n) {
+  try {
+    return in->rdbuf()->sgetn(s, n);
+  } catch (const ios_base::failure &e) {
+    cerr << "Failed to read the fastq: " << e.what() << endl;
+    return 0;
+  }
+}
+
+size_t
+FastqReader::readMore(FastqBatch &b, size_t n) {
+  growBuffer(b, n);
+  size_t got = readBytes(in, b.buf + b.bufLen, n);
+  b.bufLen += got;
+  return got;
+}
+
+bool
+FastqReader::fillStream(FastqBatch &b, unsigned maxRecs) {
+  unsigned n = 0;
+  size_t pos = 0, next;
+
+  // start with what was left over from the last batch
+  b.bufLen = 0;
+  if (carry.size()) {
+    growBuffer(b, carry.size());
+    memcpy(b.buf, &carry[0], carry.size());
+    b.bufLen = carry.size();
+    carry.clear();
+  }
+
+  while (n < maxRecs) {
+    if (pos >= b.bufLen && eof)
+      break;
+    next = parseRecord(b.buf, pos, b.bufLen, eof, b.recs[n]);
+    if (next == NOPOS) { // the record is incomplete; read in some more
+      if (readMore(b, READCHUNK) == 0)
+        eof = true;
+      continue;
+    }
+    pos = next;
+    ++n;
+  }
+
+  // the records are complete (and the buffer is done moving); encode them
+  b.base = b.buf;
+  b.codesLen = b.masksLen = 0;
+  for (unsigned i=0; i < n; ++i)
+    b.encode(b.recs[i]);
+
+  // the start of the next batch
+  carry.assign(b.buf + pos, b.buf + b.bufLen);
+  if (carry.empty() && ! eof) { // peek; is there more?
+    carry.resize(READCHUNK);
+    carry.resize(readBytes(in, &carry[0], READCHUNK));
+    if (carry.empty())
+      eof = true;
+  }
+
+  b.numRecs = n;
+  return eof && carry.empty();
+}
@@ -0,0 +1,207 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef INPUT_H_
+#define INPUT_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <streambuf>
+#include <istream>
+#include <fstream>
+
+#ifndef NOZLIB
+#include <zlib.h>
+#endif
+
+#include "lookup.h"
+
+#ifndef NOTHREADS
+#include <pthread.h>
+#endif
+
+// returns true if the file starts with the gzip magic number (this includes BGZF files)
+bool isGzipFile(const char *file);
+
+#ifndef NOZLIB
+
+// the number of (inflated) bytes made at a time from a plain gzip file
+#define GZCHUNK (1 << 20)
+// the number of BGZF blocks (each is at most 64kb inflated) that are inflated together
+#define BGZFBLOCKS 16
+
+// a piece of the decompressed file.
+struct GzSlot {
+  std::vector<unsigned char> in; // the compressed BGZF blocks (unused with plain gzip)
+  std::vector<unsigned> blockStarts; // where each BGZF block starts in *in
+  std::vector<char> out; // the inflated data
+  size_t outLen; // how much of *out is used
+  int state; // see GZ_EMPTY ...
+  bool last; // whether or not this is the end of the file
+  std::string error; // why the decompression failed (empty if it didn't); reported by underflow
+};
+
+/*
+  A streambuf that decompresses a gzip file (so it can be read with an istream, getline, ...)
+  Plain gzip files are inflated on a dedicated thread (so decompression overlaps with the rest of the work)
+  BGZF files are made of independent blocks; these are read by one thread and inflated in parallel by numThreads threads
+  Either way the decompressed data are handed out in order.
+  Without threads (NOTHREADS), the decompression happens when the data are asked for.
+*/
+class GzipStreamBuf : public std::streambuf {
+ public:
+  GzipStreamBuf(const char *file, int numThreads);
+  ~GzipStreamBuf();
+
+  bool is_open() { return f != NULL; }
+  bool isBgzf() { return bgzf; }
+
+ protected:
+  int underflow();
+
+ private:
+  // (plain gzip) inflates the next GZCHUNK bytes of the file into the slot.
+  void inflateStream(GzSlot &s);
+  // (BGZF) reads the next BGZFBLOCKS blocks into the slot
+  void readBlocks(GzSlot &s);
+  // (BGZF) and inflates them
+  void inflateBlocks(GzSlot &s);
+
+  FILE *f;
+  bool bgzf;
+  bool started;
+  std::vector<GzSlot> slots; // a ring of slots; slot i%slots.size() has the i-th piece of the file
+  unsigned long consumed; // the piece being read by underflow
+
+  // for plain gzip
+  z_stream strm;
+  std::vector<unsigned char> inbuf;
+  bool streamDone;
+
+#ifndef NOTHREADS
+  static void *readerMain(void *arg);
+  static void *inflaterMain(void *arg);
+  void stopThreads();
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // signaled whenever a slot changes state
+  pthread_t reader;
+  std::vector<pthread_t> inflaters;
+  unsigned long nextToInflate; // (BGZF) the next piece that needs inflating
+  bool stopping;
+  bool threaded;
+#endif
+};
+
+#endif
+
+// a fastq record. the sequence and quality strings are (offset, length) views into the batch's memory
+// (the header and the + line are not kept)
+struct FastqRecord {
+  size_t seq;
+  unsigned seqLen;
+  size_t qual;
+  unsigned qualLen;
+  size_t code; // where the sequence's 2-bit codes start in the batch's codes
+  size_t mask; // and its ambiguity mask (in the batch's masks)
+  bool valid; // false if the sequence has characters that are not DNA
+};
+
+// a batch of fastq records
+struct FastqBatch {
+  FastqBatch();
+  ~FastqBatch();
+
+  const char *seq(unsigned i) { return base + recs[i].seq; }
+  const char *qual(unsigned i) { return base + recs[i].qual; }
+  // the sequence in its 2-bit encoding (see encodeRead)
+  EncodedRead read(unsigned i) {
+    EncodedRead r = { &codes[ recs[i].code ], &masks[ recs[i].mask ], recs[i].seqLen };
+    return r;
+  }
+  // encodes the sequence of record r (and checks it); see encodeRead
+  void encode(FastqRecord &r);
+
+  char *base; // what the records are views into; either a memory-mapped file, or buf
+  std::vector<FastqRecord> recs;
+  unsigned numRecs; // the number of records in use (recs may be bigger)
+
+  // the storage for records read from a stream (ie, not memory-mapped)
+  char *buf;
+  size_t bufLen;
+  size_t bufCap;
+
+  // the encoded sequences (codesLen and masksLen are in use)
+  std::vector<unsigned char> codes;
+  size_t codesLen;
+  std::vector<uint64_t> masks;
+  size_t masksLen;
+};
+
+/*
+  Reads fastq records, a batch at a time.
+  Plain files (and stdin, if it's a regular file) are memory-mapped and the records refer to the map; nothing is copied
+  Everything else (gzip, pipes) is read into the batch's own memory.
+  Either way, sequences are made upper-case (in place), checked and encoded as they are parsed (see encodeRead)
+*/
+class FastqReader {
+ public:
+  FastqReader();
+  ~FastqReader();
+
+  // opens a fastq file (gzipped files are decompressed with numThreads threads; see GzipStreamBuf)
+  bool open(const char *file, int numThreads);
+  // reads from standard in
+  void openStdin();
+  void close();
+
+  // reads (up to) maxRecs records into the batch
+  // returns true if the input is exhausted (ie, this is the last batch)
+  bool fill(FastqBatch &b, unsigned maxRecs);
+
+ private:
+  bool mapFile(int fd);
+  bool fillMapped(FastqBatch &b, unsigned maxRecs);
+  bool fillStream(FastqBatch &b, unsigned maxRecs);
+  // appends (up to) n bytes from the stream to the batch's buffer; returns the number of bytes read
+  size_t readMore(FastqBatch &b, size_t n);
+
+  // memory-mapped input
+  char *map;
+  size_t mapLen;
+  size_t mapPos; // where the next record starts
+
+  // stream input
+  std::istream *in;
+  std::ifstream file;
+#ifndef NOZLIB
+  GzipStreamBuf *gz;
+  std::istream gzin;
+#endif
+  std::vector<char> carry; // the (partial) record at the end of the last batch
+  bool eof;
+};
+
+#endif
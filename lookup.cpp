@@ -29,6 +29,13 @@ SOFTWARE.
 #include <algorithm>
 #include <climits>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
 #include "constants.h"
 #include "lookup.h"
 #include "str8.h"
@@ -54,6 +61,22 @@ using namespace std;
 
 
 
+// the 2-bit code of every (ascii) letter; A is 0, C is 1, G is 2 and everything else is 3 (T)
+struct BaseCodes {
+  unsigned char code[256];
+
+  BaseCodes() {
+    memset(code, 3, sizeof(code));
+    code[(unsigned char)'A'] = 0;
+    code[(unsigned char)'C'] = 1;
+    code[(unsigned char)'G'] = 2;
+  }
+
+  unsigned char operator[](unsigned char c) const { return code[c]; }
+};
+
+static const BaseCodes BASECODES;
+
 /*
   Takes in an arbitrary word
   and a letter in the DNA alphabet
@@ -67,22 +90,9 @@ setLetter(binaryword w, char letter, unsigned pos) {
 
   pos = MAXWORD - 2 - (pos + pos);
   
-
-  if (letter == 'A') { // clear two bits
-    w &= ~( ((binaryword)3) << pos);
-  } else if (letter == 'C') { // C is 01 in this schema
-    w |= ((binaryword)1) << (pos); // set 1 bit to 1
-    w &= ~( ((binaryword)1) << (pos+1)); // set the next bit to 0
-  } else if (letter == 'G') {
-    w |= ((binaryword)1) << (pos+1); //  and vice versa
-    w &= ~( ((binaryword)1) << (pos)); //
-  } else { // setting two bits
-    w |= ((binaryword)3) << (pos);
-  }
-
-  return w;
+  // A is 00, C is 01, G is 10 and everything else (T) is 11
+  return (w & ~( ((binaryword)3) << pos)) | ((binaryword) BASECODES[ (unsigned char) letter ] << pos);
 }
-
 /*
   Takes in an arbitrary word
   and a letter in the DNA alphabet
@@ -95,18 +105,116 @@ getLetter(binaryword w, unsigned pos) {
 
   pos = MAXWORD - 2 - (pos + pos);  
 
-  binaryword twobit = (w >> pos) & ((binaryword)3);
-  if (twobit==0) {
-    return 'A';
-  } else if (twobit == 1) {
-    return 'C';
-  } else if (twobit == 2) {
-    return 'G';
+  return "ACGT"[ (w >> pos) & ((binaryword)3) ];
+}
+
+
+// the 2-bit codes of 8 letters, one per byte (of a little-endian word)
+static inline uint64_t
+baseCodes8(const char *s) {
+  uint64_t codes;
+#ifdef __SSE2__
+  // A -> 0, C -> 1, G -> 2, anything else -> 3
+  __m128i v = _mm_loadl_epi64((const __m128i*) s);
+  __m128i isA = _mm_cmpeq_epi8(v, _mm_set1_epi8('A'));
+  __m128i isC = _mm_cmpeq_epi8(v, _mm_set1_epi8('C'));
+  __m128i isG = _mm_cmpeq_epi8(v, _mm_set1_epi8('G'));
+  __m128i c = _mm_andnot_si128(_mm_or_si128(isA, _mm_or_si128(isC, isG)), _mm_set1_epi8(3));
+  c = _mm_or_si128(c, _mm_and_si128(isC, _mm_set1_epi8(1)));
+  c = _mm_or_si128(c, _mm_and_si128(isG, _mm_set1_epi8(2)));
+  _mm_storel_epi64((__m128i*) &codes, c);
+#else
+  unsigned char b[8];
+  for (unsigned i=0; i < 8; ++i)
+    b[i] = BASECODES[ (unsigned char) s[i] ];
+  memcpy(&codes, b, sizeof(codes));
+#endif
+  return codes;
+}
+
+// packs 8 letters into 16 bits (the first letter in the 2 most significant bits)
+static inline binaryword
+packBases(const char *s) {
+  // the first letter is made the most significant byte
+  uint64_t x = __builtin_bswap64(baseCodes8(s));
+#ifdef __BMI2__
+  return _pext_u64(x, 0x0303030303030303ULL);
+#else
+  // squeeze the 2-bit codes together (pairs of bytes, then pairs of those...)
+  x = (x | (x >> 6)) & 0x000F000F000F000FULL;
+  x = (x | (x >> 12)) & 0x000000FF000000FFULL;
+  return (x | (x >> 24)) & 0xFFFF;
+#endif
+}
+
+bool
+encodeRead(char *s, unsigned len, unsigned char *codes, uint64_t *ambiguous) {
+
+  unsigned i=0;
+  bool valid=true;
+
+  memset(ambiguous, 0, AMBIGUOUSWORDS(len) * sizeof(uint64_t));
+
+#ifdef __SSE2__
+  // 16 bases at a time: the codes are stored, and the non-ACGT bases are gathered into the mask (by movemask)
+  const __m128i A = _mm_set1_epi8('A'), C = _mm_set1_epi8('C'), G = _mm_set1_epi8('G'), T = _mm_set1_epi8('T');
+  const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2), three = _mm_set1_epi8(3);
+  const __m128i beforeA = _mm_set1_epi8('A' - 1), afterT = _mm_set1_epi8('T' + 1);
+  const __m128i beforeLowA = _mm_set1_epi8('a' - 1), afterLowZ = _mm_set1_epi8('z' + 1), caseBit = _mm_set1_epi8('a' - 'A');
+  __m128i bad = _mm_setzero_si128();
+  for ( ; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, beforeLowA), _mm_cmplt_epi8(v, afterLowZ));
+    if (_mm_movemask_epi8(lower)) { // (a-z only; ie, toupper in the C locale)
+      v = _mm_sub_epi8(v, _mm_and_si128(lower, caseBit));
+      _mm_storeu_si128((__m128i*) (s + i), v);
+    }
+    // (the bytes > 127 are negative, so they're caught too)
+    bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmplt_epi8(v, beforeA), _mm_cmpgt_epi8(v, afterT)));
+
+    __m128i isC = _mm_cmpeq_epi8(v, C);
+    __m128i isG = _mm_cmpeq_epi8(v, G);
+    __m128i isT = _mm_cmpeq_epi8(v, T);
+    __m128i c = _mm_or_si128(_mm_and_si128(isC, one), _mm_or_si128(_mm_and_si128(isG, two), _mm_and_si128(isT, three)));
+    _mm_storeu_si128((__m128i*) (codes + i), c);
+
+    __m128i acgt = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, A), isC), _mm_or_si128(isG, isT));
+    uint64_t amb = (~_mm_movemask_epi8(acgt)) & 0xFFFF;
+    ambiguous[i >> 6] |= amb << (i & 63); // (i is a multiple of 16, so this never spans two words)
+  }
+  valid = _mm_movemask_epi8(bad) == 0;
+#endif
+
+  for ( ; i < len; ++i) {
+    if (s[i] >= 'a' && s[i] <= 'z')
+      s[i] -= 'a' - 'A';
+    unsigned char ch = s[i];
+    if (ch < 'A' || ch > 'T')
+      valid = false;
+    codes[i] = BASECODES[ch];
+    if (ch != 'A' && ch != 'C' && ch != 'G' && ch != 'T')
+      ambiguous[i >> 6] |= (uint64_t)1 << (i & 63);
   }
-  return 'T';
+
+  return valid;
 }
 
+unsigned
+nextAmbiguous(const EncodedRead &r, unsigned from) {
+
+  unsigned w = from >> 6;
+  if (from >= r.len)
+    return r.len;
+
+  uint64_t bits = r.ambiguous[w] & (MAXBINARYWORD << (from & 63));
+  while (bits == 0) {
+    if (++w >= AMBIGUOUSWORDS(r.len))
+      return r.len;
+    bits = r.ambiguous[w];
+  }
 
+  return (w << 6) + __builtin_ctzll(bits);
+}
 
 // converts a DNA string over {GATC} into a 64-bit number.
 // assumes numChars <= 32 (duh!)
@@ -116,75 +224,98 @@ getLetter(binaryword w, unsigned pos) {
 binaryword
 gatcToLong(char *s, unsigned numChars) {
 
-  unsigned i;
+  char padded[MAXWORD/2] = {0}; // (all 32 bytes are packed; the ones past numChars are masked off below)
   binaryword num=0;
 
-
-  for (i=0; i < numChars; ++i, ++s) {
-    num = setLetter(num, *s, i);
+  if (numChars < MAXWORD/2) { // (so 32 bytes can be read)
+    memcpy(padded, s, numChars);
+    s = padded;
   }
 
+  // 8 bases (16 bits) at a time
+  for (unsigned i=0; i < MAXWORD/2; i += 8)
+    num = (num << 16) | packBases(s + i);
+
+  if (numChars < MAXWORD/2) // the unused bases are A (0)
+    num &= numChars ? MAXBINARYWORD << (MAXWORD - 2*numChars) : 0;
+
   return num;
 }
-
 void
 longToGatc(binaryword num, unsigned numChars, char *buffer) {
-  unsigned i;
+  binaryToGatc(&num, numChars, buffer);
+}
 
-  memset(buffer, 'A', numChars); // initialize to 'A' (ie, 0)
-  
-  for (i=0; i < numChars; ++i, ++buffer) {
-    *buffer = getLetter(num, i);
+// the letters of the 4 bases packed in a byte (the first base is in the 2 most significant bits)
+struct FourBases {
+  char letters[256][4];
+
+  FourBases() {
+    static const char ACGT[] = "ACGT";
+    for (unsigned b=0; b < 256; ++b)
+      for (unsigned i=0; i < 4; ++i)
+        letters[b][i] = ACGT[ (b >> (6 - i - i)) & 3 ];
   }
+};
 
-}
+static const FourBases FOURBASES;
 
+// writes all 32 letters of w to out
+static inline void
+expandWord(binaryword w, char *out) {
+  for (unsigned j=0; j < sizeof(binaryword); ++j, out += 4)
+    memcpy(out, FOURBASES.letters[ (w >> (MAXWORD - 8 - 8*j)) & 0xff ], 4);
+}
 
 void
-printBinaryWord(FILE *f, binaryword w, unsigned numChars) {
+binaryToGatc(const binaryword *words, unsigned numBases, char *out) {
 
   unsigned i;
-  for (i=0; i < numChars; ++i)
-    fprintf(f, "%c", getLetter(w, i));
+  char last[MAXWORD/2];
+
+  for (i=0; i + MAXWORD/2 <= numBases; i += MAXWORD/2, ++words, out += MAXWORD/2)
+    expandWord(*words, out);
 
+  if (i < numBases) {
+    expandWord(*words, last);
+    memcpy(out, last, numBases - i);
+  }
 }
 
 void
-reverseComplement(binaryword *in, binaryword *out, unsigned numBases) {
+printBinaryWord(FILE *f, binaryword w, unsigned numChars) {
 
-  unsigned j, i = numBases-1;
-  unsigned inIndex, inBase, outIndex, outBase, prevOutIndex=UINT_MAX;
-
-  char c;
-  for (j=0 ; j < numBases; --i, ++j) {
-    inIndex = i/(MAXWORD/2);
-    inBase = i % (MAXWORD/2);
-    c = getLetter(in[inIndex], inBase);
-    if (c == 'A') {
-      c = 'T';
-    } else if (c == 'T') {
-      c = 'A';
-    } else if (c == 'G') {
-      c = 'C';
-    } else if (c == 'C') {
-      c = 'G';
-    } else {
-      fprintf(stderr, "Cannot happen! Got letter: %c\n", c);
-      exit(EXIT_FAILURE);
-    }
+  char letters[MAXWORD/2];
+  binaryToGatc(&w, numChars, letters);
+  fwrite(letters, 1, numChars, f);
+
+}
 
+// the reverse complement of all 32 bases in w
+static inline binaryword
+revcompWord(binaryword w) {
+  // the complement of a base is its bitwise not (A=00 <-> T=11, C=01 <-> G=10)
+  // and the 2-bit groups are reversed (the bytes, then the nibbles in a byte, then the pairs in a nibble)
+  w = __builtin_bswap64(~w);
+  w = ((w >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((w & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return ((w >> 2) & 0x3333333333333333ULL) | ((w & 0x3333333333333333ULL) << 2);
+}
+
+void
+reverseComplement(binaryword *in, binaryword *out, unsigned numBases) {
 
-    outIndex = j / (MAXWORD/2);
-    outBase = j %  (MAXWORD/2);
+  unsigned j, numWords = (numBases + MAXWORD/2 - 1) / (MAXWORD/2);
+  // the unused bases at the end of in are at the start of out once it's reversed; shifting them out leaves 0s in their place
+  unsigned shift = 2 * (numWords * (MAXWORD/2) - numBases);
 
-    if (outIndex != prevOutIndex)
-      out[outIndex] = 0;
+  for (j=0; j < numWords; ++j)
+    out[j] = revcompWord(in[numWords - 1 - j]);
 
-    out[outIndex] = setLetter(out[outIndex], c, outBase);
-    prevOutIndex = outIndex;
+  if (shift) {
+    for (j=0; j + 1 < numWords; ++j)
+      out[j] = (out[j] << shift) | (out[j + 1] >> (MAXWORD - shift));
+    out[j] <<= shift;
   }
 
-
 }
 
-
@@ -41,6 +41,31 @@ void reverseComplement(binaryword *in, binaryword *out, unsigned numBases);
 //  prints the (2*numChars) most significant bits in the word w to stream f
 void printBinaryWord(FILE *f, binaryword w, unsigned numChars);
 
+// writes the first numBases letters of the haplotype in words to out (4 bases at a time, from a table)
+// out is not NUL-terminated
+void binaryToGatc(const binaryword *words, unsigned numBases, char *out);
+
+// a read in its 2-bit encoding; one code per base (A, C, G, T are 0..3)
+// and a mask with a bit set for each base that is ambiguous (anything but ACGT; eg, N). the code of an ambiguous base is meaningless
+// (this is a view; the memory belongs to someone else, eg, a FastqBatch)
+struct EncodedRead {
+  const unsigned char *codes;
+  const uint64_t *ambiguous; // base i is bit i%64 of ambiguous[i/64]
+  unsigned len;
+};
+
+// the number of mask words needed for a read of len bases
+#define AMBIGUOUSWORDS(len) (((len) + 63) / 64)
+
+// in one pass, this upper-cases the len bases of s (in place; s is only written to if there is lower-case to change)
+// checks that they are DNA (ie, between A and T in the ascii table), and writes their 2-bit codes and ambiguity mask
+// (codes needs len bytes and ambiguous AMBIGUOUSWORDS(len) words)
+// returns false if s has a character that is not DNA (and the codes are then meaningless)
+bool encodeRead(char *s, unsigned len, unsigned char *codes, uint64_t *ambiguous);
+
+// returns the first ambiguous base in r at or after from (or r.len if there is none)
+unsigned nextAmbiguous(const EncodedRead &r, unsigned from);
+
 // converts a DNA string into it's representation as a 64-bit integer.
 binaryword gatcToLong(char *s, unsigned numChars);
 
@@ -0,0 +1,150 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include <iostream>
+
+#include "lookup.h"
+#include "output.h"
+
+using namespace std;
+
+OutBuffer::OutBuffer(FILE *s, size_t size) : len(0), cap(size), sink(s) {
+  buf = (char*) malloc(cap);
+  if (buf == NULL) {
+    cerr << "Failed to allocate the output buffer" << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+OutBuffer::~OutBuffer() {
+  if (sink)
+    flush();
+  free(buf);
+}
+
+void
+OutBuffer::makeRoom(size_t n) {
+  if (sink) {
+    flush();
+    if (n <= cap)
+      return;
+  }
+
+  while (len + n > cap)
+    cap += cap;
+
+  buf = (char*) realloc(buf, cap);
+  if (buf == NULL) {
+    cerr << "Failed to allocate the output buffer" << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void
+OutBuffer::writeTo(FILE *f) {
+  if (len && fwrite(buf, 1, len, f) != len) {
+    cerr << "Failed to write the output" << endl;
+    exit(EXIT_FAILURE);
+  }
+  len = 0;
+}
+
+void
+OutBuffer::putUnsigned(unsigned long v) {
+  char digits[24];
+  char *p = digits + sizeof(digits);
+
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while (v);
+
+  put(p, digits + sizeof(digits) - p);
+}
+
+void
+OutBuffer::putInt(long v) {
+  if (v < 0) {
+    put('-');
+    putUnsigned(-(unsigned long)v);
+  } else
+    putUnsigned(v);
+}
+
+// the number of digits after the decimal point (as with %f)
+#define FIXEDDIGITS 6
+#define FIXEDSCALE 1000000
+// beyond this, the rounding below isn't precise enough
+#define FIXEDMAX 1e6
+
+void
+OutBuffer::putFixed(double v) {
+
+  // v*FIXEDSCALE is off by (at most) half an ulp (< 1e-4 for v < FIXEDMAX); if that can change how v is rounded, let printf do it
+  double scaled = v * FIXEDSCALE;
+  if (! (v >= 0. && v < FIXEDMAX) || signbit(v) || fabs(scaled - floor(scaled) - 0.5) < 1e-3) {
+    printf("%f", v);
+    return;
+  }
+
+  uint64_t r = (uint64_t) (scaled + 0.5);
+  char frac[FIXEDDIGITS + 1];
+  uint64_t f = r % FIXEDSCALE;
+
+  putUnsigned(r / FIXEDSCALE);
+  frac[0] = '.';
+  for (int i=FIXEDDIGITS; i > 0; --i, f /= 10)
+    frac[i] = '0' + f % 10;
+  put(frac, sizeof(frac));
+}
+
+void
+OutBuffer::putBases(const binaryword *words, unsigned numBases) {
+  reserve(numBases);
+  binaryToGatc(words, numBases, buf + len);
+  len += numBases;
+}
+
+void
+OutBuffer::printf(const char *fmt, ...) {
+  va_list args;
+
+  va_start(args, fmt);
+  int n = vsnprintf(buf + len, cap - len, fmt, args);
+  va_end(args);
+
+  if (n >= 0 && (size_t)n >= cap - len) { // it didn't fit
+    reserve(n + 1);
+    va_start(args, fmt);
+    vsnprintf(buf + len, cap - len, fmt, args);
+    va_end(args);
+  }
+
+  if (n > 0)
+    len += n;
+}
@@ -0,0 +1,77 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "constants.h"
+
+// the size of the buffer (if it writes to a file as it goes)
+#define OUTBUFSIZE (1 << 20)
+
+/*
+  A buffer that the (tsv) output is formatted into
+  Numbers and haplotypes are formatted by hand (printf is only used as a fallback, and for anything else)
+  With a sink, the buffer is written to the sink whenever it fills up (and when it is flushed)
+  Without one, the buffer grows (so it can be filled by one thread, and written out by another)
+*/
+class OutBuffer {
+ public:
+  // (size is the initial size of the buffer)
+  OutBuffer(FILE *sink=NULL, size_t size=OUTBUFSIZE);
+  ~OutBuffer();
+
+  void put(char ch) { reserve(1); buf[len++] = ch; }
+  void put(const char *s, size_t n) { reserve(n); memcpy(buf + len, s, n); len += n; }
+  void put(const char *s) { put(s, strlen(s)); }
+  void put(const std::string &s) { put(s.data(), s.length()); }
+
+  // the same as printf with %u, %i and %f (respectively)
+  void putUnsigned(unsigned long v);
+  void putInt(long v);
+  void putFixed(double v);
+  // the first numBases letters of a (binary) haplotype
+  void putBases(const binaryword *words, unsigned numBases);
+  void printf(const char *fmt, ...);
+
+  // writes what's in the buffer to f, and empties the buffer
+  void writeTo(FILE *f);
+  // the same, to the sink
+  void flush() { writeTo(sink); }
+
+ protected:
+  void reserve(size_t n) { if (len + n > cap) makeRoom(n); }
+  void makeRoom(size_t n);
+
+  char *buf;
+  size_t len;
+  size_t cap;
+  FILE *sink;
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <iostream>
+#include <algorithm>
+
+#include "prefilter.h"
+
+using namespace std;
+
+// the 2-bit code of a base in an anchor (and -1 for anything else; eg, an ambiguity code)
+static int
+anchorCode(char c) {
+  switch (c) {
+  case 'A': return 0;
+  case 'C': return 1;
+  case 'G': return 2;
+  case 'T': return 3;
+  }
+  return -1;
+}
+
+
+// (a q-gram has 2*PREFILTERQ bits, so this isn't one)
+#define EMPTYQGRAM 0xFFFFFFFFU
+#define QGRAMHASH(w, mask) (((uint32_t)(w) * 0x9E3779B1U) & (mask))
+
+void
+AnchorFilter::build(const vector<Config> &c, unsigned numStrs, unsigned char distance, bool loci) {
+  vector<QgramLocus> added;
+  unsigned i, n;
+
+  bits.assign( ((size_t)1 << 2*PREFILTERQ) / 64, 0);
+  pending = loci ? &added : NULL;
+  for (i=0; i < numStrs; ++i) {
+    currentLocus = i;
+    addAnchor(c[i].forwardFlank, false, distance);
+    addAnchor(c[i].forwardFlank, true, distance);
+    addAnchor(c[i].reverseFlank, false, distance);
+    addAnchor(c[i].reverseFlank, true, distance);
+  }
+  pending = NULL;
+  if (! loci)
+    return;
+
+  // one entry per q-gram (MANYLOCI if it comes from more than one locus)
+  sort(added.begin(), added.end());
+  for (i=n=0; i < added.size(); ++i) {
+    if (n && added[n - 1].qgram == added[i].qgram) {
+      if (added[n - 1].locus != added[i].locus)
+        added[n - 1].locus = MANYLOCI;
+    } else
+      added[n++] = added[i];
+  }
+
+  // (the table is at most half full)
+  size_t size = 1;
+  while (size < 2 * (size_t) n)
+    size <<= 1;
+  QgramLocus empty = {EMPTYQGRAM, 0};
+  qgramLoci.assign(size, empty);
+  for (i=0; i < n; ++i) {
+    uint32_t h = QGRAMHASH(added[i].qgram, size - 1);
+    while (qgramLoci[h].qgram != EMPTYQGRAM)
+      h = (h + 1) & (size - 1);
+    qgramLoci[h] = added[i];
+  }
+}
+
+
+void
+AnchorFilter::addAnchor(const string &anchor, bool rc, unsigned char distance) {
+  unsigned i, j, len = anchor.length();
+  vector<int> codes( max(len, (unsigned) PREFILTERQ), -1);
+
+  // the anchor as it appears in the read (and whatever comes after a short anchor; -1)
+  for (j=0; j < len; ++j) {
+    if (rc) {
+      codes[j] = anchorCode(anchor[len - 1 - j]);
+      if (codes[j] >= 0)
+        codes[j] = 3 - codes[j];
+    } else
+      codes[j] = anchorCode(anchor[j]);
+  }
+
+  // a long anchor is split into (up to distance+1) pieces of q bases; the distance substitutions are spread over them
+  // so one of the pieces has at most distance/pieces of them (with distance+1 pieces, one piece is exact)
+  unsigned n = pieces(len, distance);
+  for (i=0; i < n; ++i)
+    addBall(&codes[i * PREFILTERQ], 0, 0, distance / n);
+}
+
+
+void
+AnchorFilter::addBall(const int *codes, unsigned from, uint32_t w, unsigned char distance) {
+  if (from == PREFILTERQ) {
+    bits[w / 64] |= (uint64_t)1 << (w % 64);
+    if (pending != NULL) {
+      QgramLocus q = {w, currentLocus};
+      pending->push_back(q);
+    }
+    return;
+  }
+
+  for (int b=0; b < 4; ++b) {
+    if (codes[from] < 0 || b == codes[from])
+      addBall(codes, from + 1, (w << 2) | b, distance);
+    else if (distance)
+      addBall(codes, from + 1, (w << 2) | b, distance - 1);
+  }
+}
+
+
+bool
+AnchorFilter::mayMatch(const EncodedRead &read) const {
+  unsigned s, k, start, end;
+  uint32_t w;
+  const uint32_t keep = ((uint32_t)1 << 2*PREFILTERQ) - 1;
+
+  // each run of unambiguous bases (the anchors cannot span an ambiguous base)
+  for (start=0; start < read.len; start = end + 1) {
+    end = nextAmbiguous(read, start);
+
+    // the q-gram that starts at s (the bases past the end of the run are taken to be A; a short anchor matches anything there)
+    w = 0;
+    for (k=start; k < start + PREFILTERQ - 1; ++k)
+      w = (w << 2) | (k < end ? read.codes[k] : 0);
+    for (s=start; s < end; ++s, ++k) {
+      w = ((w << 2) | (k < end ? read.codes[k] : 0)) & keep;
+      if (bits[w / 64] & ((uint64_t)1 << (w % 64)))
+        return true;
+    }
+  }
+  return false;
+}
+
+
+uint32_t
+AnchorFilter::locusOf(uint32_t w) const {
+  uint32_t h = QGRAMHASH(w, qgramLoci.size() - 1);
+  while (qgramLoci[h].qgram != w)
+    h = (h + 1) & (qgramLoci.size() - 1);
+  return qgramLoci[h].locus;
+}
+
+
+bool
+AnchorFilter::findQgrams(const EncodedRead &read, QgramHit *qgrams, unsigned max, unsigned *n) const {
+  unsigned s, k, start, end;
+  uint32_t w;
+  const uint32_t keep = ((uint32_t)1 << 2*PREFILTERQ) - 1;
+
+  // as in mayMatch, but the search goes on (every q-gram that's found is looked up)
+  *n = 0;
+  for (start=0; start < read.len; start = end + 1) {
+    end = nextAmbiguous(read, start);
+
+    w = 0;
+    for (k=start; k < start + PREFILTERQ - 1; ++k)
+      w = (w << 2) | (k < end ? read.codes[k] : 0);
+    for (s=start; s < end; ++s, ++k) {
+      w = ((w << 2) | (k < end ? read.codes[k] : 0)) & keep;
+      if (bits[w / 64] & ((uint64_t)1 << (w % 64))) {
+        if (*n == max)
+          return false;
+        qgrams[*n].pos = s;
+        qgrams[*n].locus = locusOf(w);
+        if (qgrams[ (*n)++ ].locus == MANYLOCI)
+          return false;
+      }
+    }
+  }
+  return true;
+}
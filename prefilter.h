@@ -0,0 +1,93 @@
+/*
+MIT License
+
+Copyright (c) [2017] [August E. Woerner]
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef PREFILTER_H_
+#define PREFILTER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "constants.h"
+#include "lookup.h"
+
+// the length of the q-grams used by the prefilter (the table has 4^PREFILTERQ bits)
+#define PREFILTERQ 12
+
+/*
+  A prefilter for the reads (-k)
+  Every occurrence of an anchor (within the -a Hamming distance) starts with a q-gram that's within that distance of the anchor's first q bases
+  (and with long anchors, one of its first few q-base pieces is even closer to the anchor's; see addAnchor)
+  All such q-grams (for all of the anchors, in both orientations) are kept in a bitset; anchors shorter than q are followed by every possible base
+  A read that has none of them cannot contain an anchor, so it need not be searched (and there are no false negatives)
+  Built with loci, the filter also keeps the locus each q-gram comes from (see findQgrams; used by -e)
+ */
+
+// the locus of a q-gram that comes from the anchors of more than one locus
+#define MANYLOCI 0xFFFFFFFFU
+
+// a q-gram of a read that's in the filter; where it starts, and the locus of the anchor(s) it comes from
+struct QgramHit {
+  unsigned pos;
+  unsigned locus;
+};
+
+class AnchorFilter {
+public:
+  // the anchors of the numStrs loci in c, with up to distance substitutions (and the loci of the q-grams, if loci is set)
+  void build(const std::vector<Config> &c, unsigned numStrs, unsigned char distance, bool loci=false);
+
+  // returns false if the read cannot contain any of the anchors
+  bool mayMatch(const EncodedRead &read) const;
+  // (needs loci) writes the q-grams of the read that are in the filter to qgrams (and their number to *n)
+  // an anchor of a locus can only be in the read where one of its pieces is one of these (at pos + i*PREFILTERQ, i < pieces(the anchor's length))
+  // returns false if there are more than max of them, or if one comes from more than one locus
+  bool findQgrams(const EncodedRead &read, QgramHit *qgrams, unsigned max, unsigned *n) const;
+  // the number of pieces a (long) anchor is split into
+  static unsigned pieces(unsigned len, unsigned char distance) { return std::min((unsigned) distance + 1, std::max(1U, len / PREFILTERQ)); }
+
+private:
+  // a q-gram and its locus (or MANYLOCI)
+  struct QgramLocus {
+    uint32_t qgram;
+    uint32_t locus;
+
+    bool operator < (const QgramLocus &q) const { return qgram < q.qgram; }
+  };
+
+  std::vector<uint64_t> bits; // bit w is set if the q-gram w (2-bit encoded; the first base is the most significant) can be part of an anchor
+  // with loci; a hash table (open addressing) of the q-grams in bits, and their loci
+  std::vector<QgramLocus> qgramLoci;
+  std::vector<QgramLocus> *pending; // while building with loci; the q-grams that were added (and their loci)
+  unsigned currentLocus;
+
+  // adds the q-grams that an occurrence of the anchor (or of its reverse complement) within distance must contain
+  void addAnchor(const std::string &anchor, bool rc, unsigned char distance);
+  // sets the bits of all words within distance of codes[from, q); codes that aren't 0..3 (eg, ambiguity codes) match any base
+  void addBall(const int *codes, unsigned from, uint32_t w, unsigned char distance);
+  // the locus of the q-gram w (which must be in bits)
+  uint32_t locusOf(uint32_t w) const;
+};
+
+#endif
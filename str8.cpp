@@ -46,13 +46,18 @@ SOFTWARE.
 
 #ifndef NOTHREADS
 #include <pthread.h>
-#include <semaphore.h>
 #include <atomic>
 #endif
 
 #include "lookup.h"
 #include "str8.h"
 #include "trie.h"
+#include "index.h"
+#include "input.h"
+#include "haplotypes.h"
+#include "output.h"
+#include "prefilter.h"
+#include "amplicon.h"
 
 // version of strait razor!
 const float VERSION_NUM = 3.01;
@@ -60,9 +65,16 @@ const float VERSION_NUM = 3.01;
 
 using namespace std;
 
-// the number of fastq records kept in memory (*2 ; one for each buffer in the double buffer)
-#define RECSINMEM 50000
-unsigned LASTREC = UINT_MAX;
+// the number of fastq records in a batch (default)
+#define DEFAULTBATCHSIZE 10000
+// the number of batches (per thread) that are kept in memory (default)
+#define BATCHESPERTHREAD 2
+// the number of (consecutive) records a worker claims at a time
+#define CHUNKSIZE 512
+// haplotypes up to this many binarywords long are built on the stack
+#define STACKHAPWORDS 32
+// the number of reads whose trie matches are found together (a multiple of TRIECURSORS)
+#define READGROUP 64
 
 
 // for the command-line options
@@ -83,113 +95,91 @@ struct Options {
   unsigned char distance; // hamming distance; used with anchors
   unsigned char motifDistance; // hamming distance ; used with motifs
   bool useTrie; // defunct; always 1
+  bool lazyMotifs; // default false. when set, the motifs are not in the trie; they're looked for (between the flanks) after the flanks are found
+  bool prefilter; // default false. when set, reads that cannot contain an anchor (see AnchorFilter) are not searched
+  bool amplicon; // default false. when set, the anchors a read can have are looked up (by its q-grams), and only those are searched for (see AmpliconFinder)
   char *type;// default: NULL can constrain the config file to be just AUTOSOMES (filters on type in the config file)
+  char *buildIndex; // default: NULL. when set, the trie is written to this file (and no fastqs are read)
+  unsigned batchSize; // the number of fastq records read at a time. default DEFAULTBATCHSIZE
+  unsigned ringDepth; // the number of batches in memory (multithreaded only). default: BATCHESPERTHREAD*numThreads
 };
 
 
-// the anatomy of what we keep for a haplotype
-struct Report {
-  unsigned strIndex; // which haplotype
-  binaryword *haplotype; // unique sequence between the flanks
-  bool nonstandardLetters; // are there nonstandard letters (outside of ste GATC)? If so, then binaryword is actually a char*
-  int hapLength; // the length of *haplotype in CHARACTERS (ie, in the set {GATC}). ie, the number of bits*2 used in *haplotype
-};
 
-struct CompareReport {
 
-  bool operator() (const Report &a, const Report &b) const {
-    //TODO: Handle string/float pair instead of lexicographic ordering
+Options opt; // parsed command-line options
 
-    unsigned i1 = a.strIndex;
-    unsigned i2 = b.strIndex;
+// variables used for IO:
+FastqReader reader; // reads stdin / current file opened for reading. fastq format is assumed.
 
-    // different loci
-    if (i2 < i1) 
-      return false;
-    else if (i1 < i2) 
-      return true;
+// multithreading variables:
+#ifndef NOTHREADS
+// the reader (writerThread) fills batches of fastq records, and the workers claim them (CHUNKSIZE records at a time)
+// the i-th batch of the file goes in ring[ i % opt.ringDepth ]
+struct RingSlot {
+  FastqBatch batch;
+  std::atomic<bool> full; // set when the batch has been read in, and cleared when the batch has been processed
+  // the claims on this batch that are still being worked on, less the claims made (which is only known once the batch has been handed out)
+  // the batch is done when this returns to 0
+  std::atomic<long> pending;
+};
 
+RingSlot *ring=NULL;
+std::atomic<unsigned long> batchesRead(0); // the number of batches the reader has filled (so far)
+// where the next claim starts; the batch number (high 32 bits) and the record in that batch (low 32 bits)
+std::atomic<uint64_t> cursor(0);
+std::atomic<bool> done(0); // whether or not the file has been consumed (ie, batchesRead is final)
 
-    // different haplotype lengths; ergo different haplotypes
-    if (a.hapLength < b.hapLength)
-      return true;
-    else if (a.hapLength > b.hapLength)
-      return false;
+// the number of times a waiting thread checks its condition before going to sleep
+#define SPINS 1000
 
-    // one haplotype has nonstandard letters and the other does not.    
-    if (a.nonstandardLetters == false && b.nonstandardLetters==true)
-      return false;
-    else if (a.nonstandardLetters == true && b.nonstandardLetters==false)
-      return true;
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX()
+#endif
 
-    if (a.nonstandardLetters==false) { // compare binary words
+// threads wait here for a condition (on the ring) to become true; they spin briefly, and then sleep
+// wake must be called after anything that can make the condition true
+struct Waiter {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  std::atomic<int> sleepers; // the number of threads asleep (or about to be). wake is a no-op if there are none
 
-    // compute the (min) length in binarywords of the two haplotypes
-      unsigned i, lengthInWords = ceil( min(a.hapLength, b.hapLength)/ (MAXWORD/2.0));
-      binaryword *b1 = a.haplotype;
-      binaryword *b2 = b.haplotype;
-      
-      for (i=0; i < lengthInWords; ++i, ++b1, ++b2) {
-        if (*b1 < *b2)
-          return true;
-        else if (*b1 > *b2)
-          return false;
-      }
-
-    } else { // compare char*s
-      char *b1 = (char*) a.haplotype;
-      char *b2 = (char*) b.haplotype;
+  Waiter() : sleepers(0) {
+    if (pthread_mutex_init(&lock, NULL) || pthread_cond_init(&cond, NULL)) {
+      cerr << "Failed to init mutex..." << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
 
-      for (int i=0; i < a.hapLength; ++i, ++b1, ++b2) {
-        if (*b1 < *b2)
-          return true;
-        else if (*b1 > *b2)
-          return false;
-      }
+  template <class Ready>
+  void wait(Ready ready) {
+    for (int i=0; i < SPINS; ++i) {
+      if (ready())
+        return;
+      CPU_RELAX();
     }
 
-    return false;
-    
+    pthread_mutex_lock(&lock);
+    ++sleepers; // (before the last check of the condition; so wake cannot miss us)
+    while (! ready())
+      pthread_cond_wait(&cond, &lock);
+    --sleepers;
+    pthread_mutex_unlock(&lock);
   }
 
+  void wake() {
+    if (sleepers) {
+      pthread_mutex_lock(&lock);
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&lock);
+    }
+  }
 };
 
-
-
-
-Options opt; // parsed command-line options
-
-// variables used for IO:
-std::atomic<bool> done(0); // whether or not the file has been consumed
-std::atomic<bool> nextdone(0); // this is the penultimate done ; ie, whether or not the 2nd buffer exhausted the filehandle
-
-string MEM[ RECSINMEM ]; // buffers used for processing
-string OTHERMEM[ RECSINMEM ]; // these contain the DNA strings from the fastq file
-
-string QMEM[ RECSINMEM ]; // buffers used for processing
-string OTHERQMEM[ RECSINMEM ]; // these contain the DNA QUALITY strings from the fastq file
-
-
-string *records=NULL; // pointer used to alterante between MEM and OTHERMEM
-string *qrecords=NULL; // parallel array to records; contains quality scores
-
-istream *currentInputStream; //pointer to stdin / current file opened for reading. fastq format is assumed.
-
-// multithreading variables:
-#ifndef NOTHREADS
-pthread_mutex_t ioLock;
-
-// OSX requires named semaphores. yay. Windows does not work with named semaphores. boo.
-#ifdef OSX
-sem_t *writersLock; // used to block the writer. modified to be a named semaphore for OSX compatibility (annoying!)
-#else
-sem_t writersLock;
-#endif
-
-// bugfix; was volatile.
-std::atomic<int> workersWorking(0); // the number of workers processing fastq records
-std::atomic<bool> buffered(0);
-std::atomic<int> startedWorking(0);
+Waiter batchReady; // the workers wait here for the reader to fill a batch
+Waiter slotFree; // and the reader waits here for the workers to finish with one
 #endif
 
 
@@ -213,10 +203,63 @@ char USE_QVALS = NO_QUALITY;
 // information about the strs from the file:
 vector<Config> *c;
 unsigned numStrs; // number of records in the array *c
+
+// the (integer) fields of the strs that the search and the reports use, one array per field
+// these are copied out of *c (whose strings spread them over ~200 bytes per locus), so that the fields of a whole panel take up a few cache lines
+struct LocusTable {
+  vector<uint32_t> forwardLength;
+  vector<uint32_t> reverseLength;
+  vector<unsigned short> forwardCount;
+  vector<unsigned short> reverseCount;
+  vector<unsigned short> motifPeriod;
+  vector<unsigned short> motifOffset;
+  // the motif (and its reverse complement) as the last 2*motifLength bits of a binaryword (only with -l)
+  vector<binaryword> motif;
+  vector<binaryword> motifRC;
+  vector<unsigned char> motifLength;
+
+  void build(const vector<Config> &conf, unsigned n) {
+    forwardLength.resize(n);
+    reverseLength.resize(n);
+    forwardCount.resize(n);
+    reverseCount.resize(n);
+    motifPeriod.resize(n);
+    motifOffset.resize(n);
+    for (unsigned i=0; i < n; ++i) {
+      forwardLength[i] = conf[i].forwardLength;
+      reverseLength[i] = conf[i].reverseLength;
+      forwardCount[i] = conf[i].forwardCount;
+      reverseCount[i] = conf[i].reverseCount;
+      motifPeriod[i] = conf[i].motifPeriod;
+      motifOffset[i] = conf[i].motifOffset;
+    }
+  }
+
+  // motifs of up to MAXWORD/2 bases can be looked for this way; returns false if there's a longer one
+  bool buildMotifs(const vector<Config> &conf, unsigned n) {
+    char rc[MAXWORD/2 + 1];
+    motif.resize(n);
+    motifRC.resize(n);
+    motifLength.resize(n);
+    for (unsigned i=0; i < n; ++i) {
+      unsigned len = conf[i].motifLength;
+      if (len > MAXWORD/2)
+        return false;
+      revcompCstring(conf[i].strMotif.c_str(), len, rc);
+      motif[i] = gatcToLong((char*) conf[i].strMotif.c_str(), len) >> (MAXWORD - 2*len);
+      motifRC[i] = gatcToLong(rc, len) >> (MAXWORD - 2*len);
+      motifLength[i] = len;
+    }
+    return true;
+  }
+};
+LocusTable loci; // built from *c
 int minFrag; // the (minimum) fastq record size. inferred from all c
 int minLen; // min length of an anchor sequence
 int maxLen; // max length of an anchor sequence
 Trie *trie=NULL; // is only used with the Trie search...
+AnchorFilter prefilter; // with -k
+AmpliconFinder amplicons; // with -e
 
 
 // the data structures that store the OUTPUT of the computation
@@ -228,18 +271,12 @@ unsigned **totalCounts; // counts the number of times you see a left-hand anchor
 unsigned long **leftFlankPosSum; // the position (sum) of the left-hand position match
 unsigned long **rightFlankPosSum; // the position (sum) of the right-hand position match
 
-// the data structure used to keep the results
-//typedef map<Report, pair<unsigned, unsigned>, CompareReport> Matches;
-
-// first and second names are bad, but they let me very easily extend from a std::pair to this bad boy
-struct HapCounter {
-  unsigned first; // count of haplotype on forward strand
-  unsigned second; // and reverse
-  double fq;  // ditto for quality sums
-  double rq;
-};
+unsigned long *invalidReads; // the number of reads (per thread) that were skipped as they aren't DNA (see reportInvalidReads)
+unsigned long *filteredReads; // with -k, the number of reads (per thread) that were given to the prefilter (see reportRejectedReads)
+unsigned long *rejectedReads; // and the number of those that it rejected
 
-typedef map<Report, HapCounter, CompareReport> Matches;
+// the data structure used to keep the results (one per thread)
+typedef HapTable Matches;
 Matches *matches;
 
 
@@ -278,9 +315,9 @@ initQvalLUT(char qtype) {
 }
 
 // I need to sort reports by both the key, and within equivalent keys, by value.
+// (ties are broken by the haplotype, so the order does not depend on the order of the hash table)
 bool
-//sortKeyAndValue(pair<Report, pair<unsigned, unsigned> > first, pair<Report, pair<unsigned, unsigned> > second) {
-sortKeyAndValue(pair<Report, HapCounter > first, pair<Report, HapCounter > second) {
+sortKeyAndValue(const pair<Report, HapCounter > &first, const pair<Report, HapCounter > &second) {
  
 
       // first sort on the marker name
@@ -296,10 +333,12 @@ sortKeyAndValue(pair<Report, HapCounter > first, pair<Report, HapCounter > secon
 
   // markers are the same.
   // sort in descending order by their frequency
-  if (first.second.first + first.second.second > second.second.first + second.second.second)
-    return true;
+  unsigned n1 = first.second.first + first.second.second;
+  unsigned n2 = second.second.first + second.second.second;
+  if (n1 != n2)
+    return n1 > n2;
 
-  return false;
+  return CompareReport()(first.first, second.first);
 }
 
 
@@ -317,7 +356,7 @@ getProbCorrect(const char *qseq, unsigned stop) {
 
   double logsum=0.;
 
-  for(i=0; i < stop && *qseq; ++i, ++qseq) {
+  for(i=0; i < stop; ++i, ++qseq) {
     qval = *qseq - PHREDMINUS;
     if (qval < 0)
       qval = 0;
@@ -355,7 +394,7 @@ getProbCorrectEdgar(const char *qseq, unsigned stop) {
   // Error filtering, pair assembly and error correction for next-generation sequencing reads
   // Expected number of errors for a given (substring of a ) read is
   // the sum of the error probabilities
-  for(i=0; i < stop && *qseq; ++i, ++qseq) {
+  for(i=0; i < stop; ++i, ++qseq) {
 
     qval = *qseq - PHREDMINUS;
     if (qval < 0)
@@ -374,65 +413,89 @@ getProbCorrectEdgar(const char *qseq, unsigned stop) {
 }
 
 
-void
-printReports(FILE *stream, map< Report, HapCounter, CompareReport> &hash, unsigned minCount, bool noRC) {
+// the haplotypes (and their counts) as they're sorted and printed
+typedef vector< pair<Report, HapCounter > > ReportList;
 
+// appends the haplotypes in hash (and their counts) to vec
+// the reports refer to the table's memory (so the table cannot change while vec is in use)
+void
+collectReports(Matches &hash, ReportList &vec) {
+  for (unsigned h=0; h < hash.capacity(); ++h) {
+    if (hash.entry(h).key.hapLength >= 0)
+      vec.push_back( make_pair(hash.entry(h).key, hash.entry(h).count) );
+  }
+  for (unsigned h=0; h < hash.shortCapacity(); ++h) {
+    ShortHapEntry &e = hash.shortEntry(h);
+    if (e.hapLength >= 0) {
+      Report rep = {e.strIndex, &e.code, false, e.hapLength};
+      vec.push_back( make_pair(rep, e.count) );
+    }
+  }
+}
 
-  //  vector< pair<Report, pair<unsigned, unsigned> > > vec(hash.begin(), hash.end() );
+void
+printHeader(FILE *stream, bool noRC) {
+  fprintf(stream, "Locus\tLength\tHaplotype\t");
+  if (noRC) {
+    fprintf(stream, "Count");
+  } else {
+    fprintf(stream, "ForwardCount\tReverseCount");
+  }
+    
+  if (opt.useQuality) {
+    if (noRC) 
+      fprintf(stream, "\tForwardQsum");
+    else
+      fprintf(stream, "\tForwardQsum\tReverseQsum");
+  }
+  fprintf(stream, "\n");
+}
 
-  vector< pair<Report, HapCounter > > vec(hash.begin(), hash.end() );
-  sort( vec.begin(), vec.end() , sortKeyAndValue);
+// the SumBelowThreshold line of a locus
+void
+formatSkipped(OutBuffer &out, const char *locus, unsigned skippedPositive, unsigned skippedNegative, bool noRC) {
+  out.put(locus);
+  out.put(":0.0\t0 bases\tSumBelowThreshold");
+  if (noRC) {
+    out.put("\t\t");
+    out.putUnsigned(skippedPositive + skippedNegative);
+  } else {
+    out.put('\t');
+    out.putUnsigned(skippedPositive);
+    out.put('\t');
+    out.putUnsigned(skippedNegative);
+  }
+  out.put('\n');
+}
 
+// formats the reports in [first, last) (which are sorted with sortKeyAndValue, and have no duplicates) and appends them to out
+// haplotypes seen < minCount times are summed up (SumBelowThreshold) at the end of each locus
+void
+formatReports(OutBuffer &out, ReportList::iterator first, ReportList::iterator last, unsigned minCount, bool noRC) {
 
-  vector< pair<Report, HapCounter > >::iterator it = vec.begin();
+  ReportList::iterator it = first;
 
-  unsigned i, j, stop, mod;
   int offset, period;
-  string s;
+  const char *s = "";
   unsigned totalSkippedPositive = 0;
   unsigned totalSkippedNegative = 0;
   unsigned prevStrIndex = UINT_MAX;
   Report rep;
-  
-  if (opt.printHeader) {
-    fprintf(stream, "Locus\tLength\tHaplotype\t");
-    if (noRC) {
-      fprintf(stream, "Count");
-    } else {
-      fprintf(stream, "ForwardCount\tReverseCount");
-    }
-    
-    if (opt.useQuality) {
-      if (noRC) 
-        fprintf(stream, "\tForwardQsum");
-      else
-        fprintf(stream, "\tForwardQsum\tReverseQsum");
-    }
-    fprintf(stream, "\n");
-  }
 
-  
-  for ( ; it != vec.end(); ++it) {
+  for ( ; it != last; ++it) {
 
     rep = it->first;
 
     // print out the number of records that were below threshold.    
     // the outer-most sort is by locus, so this approach is correct
     if (rep.strIndex != prevStrIndex) {
-      if (totalSkippedPositive + totalSkippedNegative >0) {
-
-        fprintf(stream, "%s:0.0\t0 bases\tSumBelowThreshold",  s.c_str());
-        if (noRC) 
-          fprintf(stream, "\t\t%u\n",  totalSkippedPositive + totalSkippedNegative);
-        else
-          fprintf(stream, "\t%u\t%u\n",  totalSkippedPositive , totalSkippedNegative);
-        
-      }
+      if (totalSkippedPositive + totalSkippedNegative >0)
+        formatSkipped(out, s, totalSkippedPositive, totalSkippedNegative, noRC);
       prevStrIndex = rep.strIndex;
       totalSkippedPositive = totalSkippedNegative = 0;
     }
 
-    s = (*c)[rep.strIndex].locusName;
+    s = (*c)[rep.strIndex].locusName.c_str();
 
     if (it->second.first + it->second.second < minCount) {
       totalSkippedPositive += it->second.second;
@@ -441,167 +504,310 @@ printReports(FILE *stream, map< Report, HapCounter, CompareReport> &hash, unsign
     }
 
     // compute the STR nomenclature
+    int motifOffset = loci.motifOffset[rep.strIndex];
+    int motifPeriod = loci.motifPeriod[rep.strIndex];
     if (opt.includeAnchors) {
       // adjust the nomenclature to account for the inclusion of the anchor sequences in the haplotype.
-      period = ( (int)rep.hapLength- (int)(*c)[rep.strIndex].motifOffset - (int)(*c)[rep.strIndex].forwardLength - (int)(*c)[rep.strIndex].reverseLength )/ (int)(*c)[rep.strIndex].motifPeriod;
-      offset = ( (int)rep.hapLength-(int)(*c)[rep.strIndex].motifOffset- (int)(*c)[rep.strIndex].forwardLength - (int)(*c)[rep.strIndex].reverseLength ) % (int)(*c)[rep.strIndex].motifPeriod;
+      int anchors = (int)loci.forwardLength[rep.strIndex] + (int)loci.reverseLength[rep.strIndex];
+      period = ( (int)rep.hapLength- motifOffset - anchors )/ motifPeriod;
+      offset = ( (int)rep.hapLength- motifOffset - anchors ) % motifPeriod;
     } else {
-      period = ( (int)rep.hapLength- (int)(*c)[rep.strIndex].motifOffset)/ (int)(*c)[rep.strIndex].motifPeriod;
-      offset = ( (int)rep.hapLength-(int)(*c)[rep.strIndex].motifOffset) % (int)(*c)[rep.strIndex].motifPeriod;
+      period = ( (int)rep.hapLength- motifOffset)/ motifPeriod;
+      offset = ( (int)rep.hapLength- motifOffset) % motifPeriod;
     }
+    // ie, locus:period[.offset]\tlength bases\t
+    out.put(s);
+    out.put(':');
+    out.putInt(period);
     if (offset) {
-      fprintf(stream, "%s:%i.%i\t%u bases\t",  s.c_str(), period, offset,
-              rep.hapLength);
-    } else {
-      fprintf(stream, "%s:%i\t%u bases\t", s.c_str(), period, 
-              rep.hapLength);
+      out.put('.');
+      out.putInt(offset);
     }
+    out.put('\t');
+    out.putUnsigned(rep.hapLength);
+    out.put(" bases\t");
 
-    if (rep.nonstandardLetters==false) {
-      stop = (rep.hapLength / (MAXWORD/2.0));
-      mod = rep.hapLength % (MAXWORD/2);
-      for (i=0; i < stop; ++i) 
-        printBinaryWord(stream, rep.haplotype[i], MAXWORD/2);
-      
-      if (mod) 
-        printBinaryWord(stream, rep.haplotype[i], mod);
+    if (rep.nonstandardLetters==false)
+      out.putBases(rep.haplotype, rep.hapLength);
+    else
+      out.put((char*)rep.haplotype);
 
+    if (noRC) {
+      out.put("\t\t");
+      out.putUnsigned(it->second.first + it->second.second);
     } else {
-      fprintf(stream, "%s", (char*)rep.haplotype);
+      out.put('\t');
+      out.putUnsigned(it->second.second);
+      out.put('\t');
+      out.putUnsigned(it->second.first);
     }
 
-      
-    if (noRC)
-      fprintf(stream, "\t\t%u", it->second.first + it->second.second );
-    else 
-      fprintf(stream, "\t%u\t%u", it->second.second, it->second.first );
-
     if (USE_QVALS) {
       
-      if (noRC)
-        fprintf(stream, "\t\t%f\n", it->second.fq + it->second.rq );
-      else 
-        fprintf(stream, "\t%f\t%f\n", it->second.rq, it->second.fq );
+      if (noRC) {
+        out.put("\t\t");
+        out.putFixed(it->second.fq + it->second.rq);
+      } else {
+        out.put('\t');
+        out.putFixed(it->second.rq);
+        out.put('\t');
+        out.putFixed(it->second.fq);
+      }
       
-    } else {
-      fprintf(stream, "\n");
     }
+    out.put('\n');
   }
 
   // grab the trailing values (if necessary)
-  if (totalSkippedPositive + totalSkippedNegative >0) {
-    
-    fprintf(stream, "%s:0.0\t0 bases\tSumBelowThreshold",  s.c_str());
-    if (noRC) 
-      fprintf(stream, "\t\t%u\n",  totalSkippedPositive + totalSkippedNegative);
-    else
-      fprintf(stream, "\t%u\t%u\n",  totalSkippedPositive , totalSkippedNegative);
-    
-  }
-  
-  
-  if (opt.verbose) {
-    fprintf(stream, "\n\nBias Reporting\nMarkerName\tMissingRightanchor_Counts\tTotalMatches_Count\tRatio\tAvgLeftPos\tAvgRightPos\n");
-    unsigned sum, sumt;
-    unsigned long leftC, rightC;
-    for (j=0; j < numStrs; ++j) {
-      sumt=sum=0;
-      leftC=rightC=0;
-      for (i=0; i < (unsigned)opt.numThreads; ++i) {
-        sum += biasCounts[i][j];
-        sumt += totalCounts[i][j];
-        leftC += leftFlankPosSum[i][j];
-        rightC += rightFlankPosSum[i][j];
-      }
+  if (totalSkippedPositive + totalSkippedNegative >0)
+    formatSkipped(out, s, totalSkippedPositive, totalSkippedNegative, noRC);
+}
 
-      fprintf(stream,  "%s\t%u\t%u\t" , (*c)[j].locusName.c_str(), sum, sumt);
-      if (sumt + sum) {
-        printf("%.4f\t", sum/(double)(sumt+sum));
-      } else {
-        printf("NaN\t");
-      }
+void
+printBias(FILE *stream) {
+  unsigned i, j;
+
+  fprintf(stream, "\n\nBias Reporting\nMarkerName\tMissingRightanchor_Counts\tTotalMatches_Count\tRatio\tAvgLeftPos\tAvgRightPos\n");
+  unsigned sum, sumt;
+  unsigned long leftC, rightC;
+  for (j=0; j < numStrs; ++j) {
+    sumt=sum=0;
+    leftC=rightC=0;
+    for (i=0; i < (unsigned)opt.numThreads; ++i) {
+      sum += biasCounts[i][j];
+      sumt += totalCounts[i][j];
+      leftC += leftFlankPosSum[i][j];
+      rightC += rightFlankPosSum[i][j];
+    }
 
-      if (sumt) {
-        fprintf(stream, "%.1f\t%.1f\n", leftC/(double)sumt, rightC/(double)sumt);
-      } else {
-        fprintf(stream, "NaN\tNaN\n");
-      }
-      
+    fprintf(stream,  "%s\t%u\t%u\t" , (*c)[j].locusName.c_str(), sum, sumt);
+    if (sumt + sum) {
+      printf("%.4f\t", sum/(double)(sumt+sum));
+    } else {
+      printf("NaN\t");
+    }
 
+    if (sumt) {
+      fprintf(stream, "%.1f\t%.1f\n", leftC/(double)sumt, rightC/(double)sumt);
+    } else {
+      fprintf(stream, "NaN\tNaN\n");
     }
-    
+  }
+}
 
+// tells the user about the reads (in the last file) that were skipped, as they have characters that are not DNA
+void
+reportInvalidReads(const char *file) {
+  unsigned long total = 0;
+  for (int i=0; i < opt.numThreads; ++i) {
+    total += invalidReads[i];
+    invalidReads[i] = 0;
   }
 
+  if (total)
+    cerr << "Skipped " << total << " read" << (total == 1 ? "" : "s") << " in " << file <<
+      " with characters that are not DNA (ie, outside of A-T, ignoring case). Is it a fastq file?" << endl;
 }
 
-
-// this function is to be called once ALL of the threads have been joined.
-// it combines all of the STR matches found across threads, and pools them into matches[0]
-// more efficient (multithreaded) design strategies are possible here.
+// with -k, prints the number of reads the prefilter rejected (since the last call) to stderr
 void
-printReportsMT(FILE *stream) {
-  int i;
-  // merge the maps
-  for (i=1 ; i < opt.numThreads; ++i) {
-    Matches::iterator itr = matches[i].begin();
-    // sum up all of the unique haplotypes itr->first
-    // with their associated frequency counts
-    for( ; itr != matches[i].end(); ++itr) {
-      matches[0][ itr->first ].first += itr->second.first;
-      matches[0][ itr->first ].second += itr->second.second;
-    }
+reportRejectedReads(const char *file) {
+  unsigned long total = 0, rejected = 0;
+  for (int i=0; i < opt.numThreads; ++i) {
+    total += filteredReads[i];
+    rejected += rejectedReads[i];
+    filteredReads[i] = rejectedReads[i] = 0;
   }
-  printReports(stream, matches[0], opt.minPrint,opt.noReverseComplement);
+
+  if (opt.prefilter)
+    cerr << "The prefilter (-k) rejected " << rejected << " of " << total << " reads in " << file <<
+      " (they cannot contain an anchor, so they were not searched)" << endl;
 }
 
+void
+printReports(FILE *stream, Matches &hash, unsigned minCount, bool noRC) {
 
+  ReportList vec;
+  vec.reserve(hash.size());
+  collectReports(hash, vec);
+  sort( vec.begin(), vec.end() , sortKeyAndValue);
 
-bool
-buffer(string mem[], string qmem[]) {
+  if (opt.printHeader)
+    printHeader(stream, noRC);
+
+  OutBuffer out(stream); // (written out as it fills)
+  formatReports(out, vec.begin(), vec.end(), minCount, noRC);
+  out.flush();
 
-  unsigned i=0;
-  string dummy;
+  if (opt.verbose)
+    printBias(stream);
+}
 
-  while (getline(*currentInputStream, mem[i])) {
-    getline(*currentInputStream, mem[i]); // read in the DNA string
-    // added by AW: Force to upper-case
-    for (char & c : mem[i])
-      c = toupper(c);
 
-    getline(*currentInputStream, dummy); // the +
-    getline(*currentInputStream, qmem[i]); // the quality string (ignored)
-    ++i;
-    if (i == RECSINMEM) {
-      
-      int c = currentInputStream->peek();
-      if (c == EOF) {
-        LASTREC = RECSINMEM;
-        return 1;
+#ifndef NOTHREADS
+
+/*
+  Merging the threads' tables (multithreaded only)
+  The loci are split into numShards shards (consecutive runs of loci)
+  First every thread splits its own table by shard (binThread),
+  then the threads take shards (one at a time), and sum up, sort and format the haplotypes of the shard (mergeThread)
+  The shards are printed in order (by the calling thread, as they finish), so the output is the same as printReports on a single table.
+  The threads' tables are not changed (so, as with a single thread, the counts accumulate across files)
+*/
+
+// the number of shards (per thread); more shards than threads evens out the work
+#define SHARDSPERTHREAD 8
+// the initial size of a shard's output
+#define SHARDBUFSIZE (1 << 16)
+
+unsigned numShards;
+ReportList **shardBins; // shardBins[thread][shard]: the haplotypes in that thread's table from that shard's loci
+OutBuffer **shardOut; // the formatted reports, by shard
+std::atomic<bool> *shardDone; // set once shardOut[shard] is complete
+std::atomic<unsigned> nextShard(0);
+Waiter shardReady; // the calling thread waits here for the next shard (in order) to be done
+
+// the shard of a locus
+inline unsigned
+shardOf(unsigned strIndex) {
+  return (unsigned long)strIndex * numShards / numStrs;
+}
+
+void *
+binThread(void *arg) {
+  int id = *((int*)arg);
+
+  ReportList all;
+  all.reserve(matches[id].size());
+  collectReports(matches[id], all);
+
+  for (ReportList::iterator it = all.begin(); it != all.end(); ++it)
+    shardBins[id][ shardOf(it->first.strIndex) ].push_back(*it);
+
+  return NULL;
+}
+
+void *
+mergeThread(void *arg) {
+  unsigned s;
+  int i;
+  ReportList vec;
+
+  while ((s = nextShard++) < numShards) {
+    vec.clear();
+    for (i=0; i < opt.numThreads; ++i) {
+      vec.insert(vec.end(), shardBins[i][s].begin(), shardBins[i][s].end());
+      ReportList().swap(shardBins[i][s]);
+    }
+
+    // the same haplotype (from different threads) is adjacent once sorted; sum up the counts
+    sort(vec.begin(), vec.end(), [](const pair<Report, HapCounter> &a, const pair<Report, HapCounter> &b) {
+        return CompareReport()(a.first, b.first);
+      });
+    ReportList::iterator out = vec.begin();
+    for (ReportList::iterator it = vec.begin(); it != vec.end(); ++it) {
+      if (it != vec.begin() && sameReport(out->first, it->first)) {
+        out->second.first += it->second.first;
+        out->second.second += it->second.second;
+        out->second.fq += it->second.fq;
+        out->second.rq += it->second.rq;
+      } else if (it != vec.begin()) {
+        *++out = *it;
       }
-      return 0;
     }
+    if (! vec.empty())
+      vec.erase(out + 1, vec.end());
+
+    sort(vec.begin(), vec.end(), sortKeyAndValue);
+    formatReports(*shardOut[s], vec.begin(), vec.end(), opt.minPrint, opt.noReverseComplement);
+    shardDone[s] = true;
+    shardReady.wake();
   }
-  
 
-  LASTREC = i;
-  for ( ; i < RECSINMEM; ++i) {
-    mem[i].clear();
-    qmem[i].clear();
+  return NULL;
+}
+
+// runs fn on opt.numThreads threads (with the thread ids in ids)
+void
+startThreads(void *(*fn)(void*), int *ids, vector<pthread_t> &threads) {
+  threads.resize(opt.numThreads);
+
+  for (int j=0; j < opt.numThreads; ++j) {
+    if (pthread_create(&threads[j], NULL, fn, (void*) &(ids[j]) )) {
+      cerr << "Error creating thread number: " << j << endl;
+      exit(EXIT_FAILURE);
+    }
   }
-  
-  return 1;
+}
+
+void
+joinThreads(vector<pthread_t> &threads) {
+  for (unsigned j=0; j < threads.size(); ++j)
+    pthread_join(threads[j], NULL);
+}
+
+// this function is to be called once ALL of the threads have been joined.
+// it combines all of the STR matches found across threads (see binThread, mergeThread), and prints them
+void
+printReportsMT(FILE *stream, int *ids) {
+  int i;
+  unsigned s;
+  vector<pthread_t> threads;
+
+  numShards = min(numStrs, (unsigned)opt.numThreads * SHARDSPERTHREAD);
+  shardBins = new ReportList* [ opt.numThreads ];
+  for (i=0; i < opt.numThreads; ++i)
+    shardBins[i] = new ReportList[ numShards ];
+  shardOut = new OutBuffer* [ numShards ];
+  shardDone = new std::atomic<bool> [ numShards ];
+  for (s=0; s < numShards; ++s) {
+    shardOut[s] = new OutBuffer(NULL, SHARDBUFSIZE);
+    shardDone[s] = false;
+  }
+  nextShard = 0;
+
+  startThreads(binThread, ids, threads);
+  joinThreads(threads);
+
+  if (opt.printHeader)
+    printHeader(stream, opt.noReverseComplement);
+
+  // the output is written while the rest of the shards are merged
+  startThreads(mergeThread, ids, threads);
+  for (s=0; s < numShards; ++s) {
+    shardReady.wait([s]() { return shardDone[s].load(); });
+    shardOut[s]->writeTo(stream);
+    delete shardOut[s];
+  }
+  joinThreads(threads);
+
+  if (opt.verbose)
+    printBias(stream);
+
+  for (i=0; i < opt.numThreads; ++i)
+    delete[] shardBins[i];
+  delete[] shardBins;
+  delete[] shardOut;
+  delete[] shardDone;
+}
+
+#endif
+
+
+// reads the next opt.batchSize records into mem (the DNA strings are forced to upper-case)
+// returns 1 when the input has been consumed
+bool
+buffer(FastqBatch &mem) {
+  return reader.fill(mem, opt.batchSize);
 }
 
 /*
-  This reverse-complements *dna
-  it returns allocated memory!
+  This reverse-complements *dna into revcompd (which must have room for len+1 characters)
   and it does the rev-comp in a tolerant way (nonstandard characters are retained)
   Note: 
 */
 char *
-revcompCstring(const char *dna, int len) {
-  char *revcompd = new char[ len + 1 ];
+revcompCstring(const char *dna, int len, char *revcompd) {
   revcompd[len]=0;
   int j=len-1;
   int i=0;
@@ -627,6 +833,7 @@ revcompCstring(const char *dna, int len) {
 /*
   This method takes in:
   dnasequence
+  its quality scores (and how many there are)
   left offset of a haplotype we want
   right offset of a haplotype we want
   the orientation of the match +==FORWARD, -==REVERSE,
@@ -638,7 +845,7 @@ revcompCstring(const char *dna, int len) {
 
  */
 void
-makeRecord(const char* dna, const char *qvals, unsigned left, unsigned right, unsigned char orientation, unsigned strIndex, int id) {
+makeRecord(const char* dna, const char *qvals, unsigned qvalsLen, unsigned left, unsigned right, unsigned char orientation, unsigned strIndex, int id) {
 
   int len = (int) (right - left);
   int wordlen = ceil(len / (MAXWORD/2.0)); //number of binarywords to represent a haplotype
@@ -651,44 +858,53 @@ makeRecord(const char* dna, const char *qvals, unsigned left, unsigned right, un
     }
   }
 
+  // (the quality line can be shorter than the read; the qualities aren't NUL-terminated, so only the ones that are there are used)
+  unsigned numQvals = left < qvalsLen ? min((unsigned) len, qvalsLen - left) : 0;
   double toAdd=1;
   if (USE_QVALS == EXPECT_QUALITY) {
-    toAdd=getProbCorrect(&(qvals[left]), len);
+    toAdd=getProbCorrect(&(qvals[left]), numQvals);
   } else if (USE_QVALS == EDGAR_QUALITY) {
-    toAdd=getProbCorrectEdgar(&(qvals[left]), len);
+    toAdd=getProbCorrectEdgar(&(qvals[left]), numQvals);
   }
     
 
   if (nonstandard) { // nonstandard letters are present (probably an N). Let's use the full ascii table.
-    char *hap;
+    // the haplotype is built on the stack (unless it's long); the table copies it if it's new
+    binaryword stackHap[ STACKHAPWORDS ];
+    char *hap = len < STACKHAPWORDS * (int)sizeof(binaryword) ? (char*) stackHap : new char[ len + 1 ];
     if (opt.noReverseComplement== 0 && orientation==REVERSEFLANK) {
-      hap = revcompCstring(dna+left, len);
+      revcompCstring(dna+left, len, hap);
     } else {
-      hap = new char[ len + 1 ];
-      strncpy(hap, dna+left, len);
+      memcpy(hap, dna+left, len);
     }
     hap[len]=0;
 
     Report rep = {strIndex, (binaryword*) hap, true, len};
+    HapCounter &count = matches[id].upsert(rep);
+    if (hap != (char*) stackHap)
+      delete[] hap;
+
     if (orientation==REVERSEFLANK) {
 
       if (USE_QVALS) {
-        (matches[id][rep].fq) += toAdd;
+        count.fq += toAdd;
       }
       
-      ++(matches[id][rep].first);
+      ++count.first;
     } else {
 
       if (USE_QVALS) {
-        (matches[id][rep].rq) += toAdd;
+        count.rq += toAdd;
       }
       
-      ++(matches[id][rep].second);
+      ++count.second;
     }
 
   } else { // This reduces DNA into its 2-bit encoding (saving much space, and making lookup operations faster
 
-    binaryword *t, *haplotype = new binaryword[ wordlen ];
+    // the haplotype is built on the stack (unless it's long); the table copies it if it's new
+    binaryword stackHap[2][ STACKHAPWORDS ];
+    binaryword *t, *haplotype = wordlen <= STACKHAPWORDS ? stackHap[0] : new binaryword[ wordlen ];
     t = haplotype;
     unsigned mod = len % (MAXWORD/2);
     unsigned numChars = MAXWORD/2;
@@ -707,27 +923,33 @@ makeRecord(const char* dna, const char *qvals, unsigned left, unsigned right, un
     }
     
     if (opt.noReverseComplement== 0 && orientation==REVERSEFLANK) {
-      binaryword *hap2 = new binaryword[ wordlen ];
+      binaryword *hap2 = wordlen <= STACKHAPWORDS ? stackHap[1] : new binaryword[ wordlen ];
       reverseComplement(haplotype, hap2, len);
-      delete[] (haplotype);
+      if (haplotype != stackHap[0])
+        delete[] (haplotype);
       haplotype=hap2;
     }
-    Report rep = {strIndex, haplotype, false, len};
+    // short haplotypes (eg, SNPs) have a table of their own
+    HapCounter &count = wordlen <= 1 ? matches[id].upsertShort(strIndex, len, wordlen ? haplotype[0] : 0) :
+      matches[id].upsert( Report {strIndex, haplotype, false, len} );
+    if (haplotype != stackHap[0] && haplotype != stackHap[1])
+      delete[] haplotype;
+
     if (orientation==REVERSEFLANK) {
 
       if (USE_QVALS) {
-        (matches[id][rep].fq) += toAdd;
+        count.fq += toAdd;
       }
       
-      ++(matches[id][rep].first);
+      ++count.first;
 
     } else {
       
       if (USE_QVALS) {
-        (matches[id][rep].rq) += toAdd;
+        count.rq += toAdd;
       }
       
-      ++(matches[id][rep].second);
+      ++count.second;
     }
   }
 
@@ -743,31 +965,160 @@ makeRecord(const char* dna, const char *qvals, unsigned left, unsigned right, un
 
 }
 
-// id is the thread ID (set to 1 with no multithreading) matchIds are just indexes in the config, and the type is just the 4 types...
+// where one flank (in one orientation) of a locus was found in a read
+// only the first and last positions (and the count) are ever needed, so that's all that's kept
+struct FlankHits {
+  unsigned first;
+  unsigned last;
+  unsigned n;
+
+  void clear() { n = 0; }
+  void push_back(unsigned j) {
+    if (n == 0)
+      first = j;
+    last = j;
+    ++n;
+  }
+  unsigned size() const { return n; }
+  bool empty() const { return n == 0; }
+  unsigned front() const { return first; }
+  unsigned back() const { return last; }
+};
+
+// the flanks (and motifs) found for a locus in the read at hand
+struct LocusHits {
+  FlankHits fpMatches; // forwardflank, positive strand
+  FlankHits rpMatches; // reverse flank, positive strand
+  FlankHits frMatches; // ditto for negative strand
+  FlankHits rrMatches;
+  bool touched; // set when a flank of this locus was found in the read (and the above are for this read)
+  bool validMotif; // whether or not there's a valid motif found for this locus
+  // valid means after a forwardflank or reverseflank_rc (the flanks may not be paired)
+};
+
+// the scratch space of processDNA_Trie (one per thread; it's reused from read to read, and batch to batch)
+// the work done per read is proportional to the number of loci it hits, not the number of loci there are
+struct ReadScratch {
+  vector<TrieHit> hits[READGROUP]; // the matches found in each read (of a group)
+  vector<TrieHit> ampliconHits[READGROUP]; // with -e, the anchors found by AmpliconFinder
+  bool fromAmplicons[READGROUP]; // with -e; whether the read's hits were found by AmpliconFinder (they have no motifs, which are looked for as with -l)
+  vector<LocusHits> locusHits; // indexed by locus. only the touched ones are meaningful
+  vector<unsigned> touched; // the loci that were touched by the read at hand
+
+  ReadScratch(unsigned n) : locusHits(n) {
+    for (unsigned i=0; i < n; ++i)
+      locusHits[i].touched = false;
+  }
+};
+
+// with -l
+// whether or not the motif of locus i (or its reverse complement) starts at an offset in [from, to) of read
+// within opt.motifDistance mismatches, and not across an ambiguous base (ie, where the trie would have found it)
+bool
+hasMotif(const EncodedRead &read, unsigned from, unsigned to, unsigned i) {
+
+  unsigned len = loci.motifLength[i];
+  if (read.len < len)
+    return false;
+  to = min(to, read.len - len + 1);
+  if (from >= to)
+    return false;
+
+  binaryword fwd = loci.motif[i], rc = loci.motifRC[i];
+  binaryword keep = len == MAXWORD/2 ? MAXBINARYWORD : ((binaryword)1 << 2*len) - 1;
+  binaryword w = 0, x;
+  unsigned k, filled = 0, amb = nextAmbiguous(read, from);
+
+  // slides over the read; w has the last len bases
+  for (k=from; k < to + len - 1; ++k) {
+    if (k == amb) {
+      filled = 0;
+      amb = nextAmbiguous(read, k + 1);
+      continue;
+    }
+    w = ((w << 2) | read.codes[k]) & keep;
+    if (++filled < len)
+      continue;
+    // (a base that differs has at least 1 of its 2 bits set)
+    x = w ^ fwd;
+    if (__builtin_popcountll((x | (x >> 1)) & 0x5555555555555555ULL) <= opt.motifDistance)
+      return true;
+    x = w ^ rc;
+    if (__builtin_popcountll((x | (x >> 1)) & 0x5555555555555555ULL) <= opt.motifDistance)
+      return true;
+  }
+  return false;
+}
+
+// with -l
+// the motif window, [motifStart, motifLimit), of a strand; as in the trie search, a motif counts if it comes after the first flank (start)
+// and before the count-th of the mate's flanks. the hits are ordered by start, and then by length (a tie goes to the flank; it was added to the trie first)
+// so a motif that starts where a flank does comes after it if it's at least as long
+unsigned
+motifStart(unsigned start, unsigned flankLength, unsigned i) {
+  return loci.motifLength[i] >= flankLength ? start : start + 1;
+}
+
+// FlankHits only keeps the first and last flank, so with count > 1 the last flank is used
+unsigned
+motifLimit(const FlankHits &mate, unsigned count, unsigned mateLength, unsigned stop, unsigned i) {
+  if (mate.size() < count)
+    return stop;
+  unsigned limit = count == 1 ? mate.front() : mate.back();
+  return min(stop, loci.motifLength[i] < mateLength ? limit + 1 : limit);
+}
+
+// processes records [first, last) in *batch
+// id is the thread ID (set to 1 with no multithreading)
 void
-processDNA_Trie(int id, unsigned *matchIds, unsigned char *matchTypes) {
+processDNA_Trie(FastqBatch &batch, unsigned first, unsigned last, int id, ReadScratch &scratch) {
 
 
   int a;
-  vector< vector<unsigned> > fpMatches( numStrs, vector<unsigned>(10) ); // forwardflank, positive strand
-  vector< vector<unsigned> > rpMatches( numStrs, vector<unsigned>(10) ); // reverse flank, positive strand 
-  vector< vector<unsigned> > frMatches( numStrs, vector<unsigned>(10) ); // ditto for negative strand
-  vector< vector<unsigned> > rrMatches( numStrs, vector<unsigned>(10) );
+  vector<TrieHit> *hits = scratch.hits;
+  vector<unsigned> &touched = scratch.touched;
+
+  for (a=first ; a < (int)last; ++a) {
+
+    // the reads are searched READGROUP at a time (see Trie::findAllMatches)
+    if ((a - first) % READGROUP == 0) {
+      EncodedRead reads[READGROUP];
+      unsigned k, numReads = min((unsigned) READGROUP, last - a);
+      for (k=0; k < numReads; ++k) {
+        reads[k] = batch.read(a + k);
+        if (! batch.recs[a + k].valid || (int)reads[k].len < minFrag) // (these are skipped below)
+          reads[k].len = 0;
+        else if (opt.prefilter) { // (these have no hits)
+          ++filteredReads[id];
+          if (! prefilter.mayMatch(reads[k])) {
+            ++rejectedReads[id];
+            reads[k].len = 0;
+          }
+        }
 
-  vector<unsigned > lastHitRecord( numStrs, RECSINMEM ); // the index (a in below loop) that yielded a valid hit for a paritcular locus
-  vector<unsigned char > validMotif(numStrs, 0); // whether or not there's a valid motif found for a particular STR
-  // valid means after a forwardflank or reverseflank_rc (the flanks may not be paired)
+        scratch.fromAmplicons[k] = opt.amplicon && reads[k].len && amplicons.findHits(reads[k], scratch.ampliconHits[k]);
+        if (scratch.fromAmplicons[k]) // (it's not searched by the trie)
+          reads[k].len = 0;
+      }
+      trie->findAllMatches(reads, numReads, hits);
+      for (k=0; k < numReads; ++k)
+        if (scratch.fromAmplicons[k])
+          hits[k].swap(scratch.ampliconHits[k]);
+    }
+    vector<TrieHit> &readHits = hits[ (a - first) % READGROUP ];
+    bool lazyMotifs = opt.lazyMotifs || scratch.fromAmplicons[ (a - first) % READGROUP ];
 
-  for (a=id ; a < RECSINMEM; a += opt.numThreads) {
-    const char *dna = records[a].c_str(); // ascii representation of DNA string
-    const char *qvals = qrecords[a].c_str(); // quality scores baby!
+    const char *dna = batch.seq(a); // ascii representation of DNA string
+    const char *qvals = batch.qual(a); // quality scores baby!
+    unsigned qvalsLen = batch.recs[a].qualLen;
     
-    unsigned dnalen = records[a].length();
-
-
-    //    if ((unsigned)a >= LASTREC) // creates a race condition!
-    //      break;
+    unsigned dnalen = batch.recs[a].seqLen;
 
+    // (the reads were checked when they were parsed)
+    if (! batch.recs[a].valid) {
+      ++invalidReads[id];
+      continue;
+    }
 
     if ((int)dnalen < minFrag)
       continue;    
@@ -776,187 +1127,211 @@ processDNA_Trie(int id, unsigned *matchIds, unsigned char *matchTypes) {
 
     bool gotOne=false;
     unsigned stop = dnalen - minLen + 1;
-    for (unsigned j=0; j < stop; ++j, ++dna) {
-      // this finds demonstrably wrong sequences (less than 'A' or greater than 'T' in the ascii table)
-      if (*dna < 65 || *dna > 84) {
-        cerr << "Oops! I'm detecting an illegal character in the DNA string. The character is " << *dna << endl <<
-          "And the record is " << dna << endl;
-        exit(EXIT_FAILURE);
-      }
+    // if we dont' have a single match (forward or reverse complement of reverse)
+    // and there isn't enough sequence to get the smallest possible fragment out at this offset, then we're done
+    unsigned lastStart = dnalen - minFrag + 1;
+    unsigned skipStart = UINT_MAX; // set when we stop the search for this offset early
 
+    // one pass through the (2-bit encoded) read found every anchor and motif
+    unsigned numMatches = readHits.size();
 
-      // if we dont' have a single match (forward or reverse complement of reverse
-      // and there isn't enough sequence to get the smallest possible fragment out, then we're done
-      if (! gotOne &&
-          dnalen - j < (unsigned)minFrag)
+    for (unsigned n = 0; n < numMatches; ++n) {
+      unsigned j = readHits[n].pos;
+      if (j >= stop)
         break;
 
-      unsigned numMatches = trie->findPrefixMatch((char*)(dna), maxLen, matchIds, matchTypes);
-      
-      for (unsigned n = 0; n < numMatches; ++n) {
-        unsigned strIndex = matchIds[n];
-        unsigned char orientation = matchTypes[n];
+      if (! gotOne && j >= lastStart)
+        break;
+
+      if (j == skipStart)
+        continue;
+
+      unsigned strIndex = readHits[n].id;
+      unsigned char orientation = readHits[n].type;
 
 
 #if DEBUG
-        //	if (orientation < MOTIF) 
-        cerr << "Read offset: " << j << " read # " << 
-          a << " Str index " << strIndex << " Orientation " << (unsigned)orientation << endl;
+      //	if (orientation < MOTIF) 
+      cerr << "Read offset: " << j << " read # " << 
+        a << " Str index " << strIndex << " Orientation " << (unsigned)orientation << endl;
 #endif
 
-        if (lastHitRecord[ strIndex ] != (unsigned) a &&
-            orientation < MOTIF) { // clear out the vectors for this STR; it's the first time we've seen this marker (in this read)
-          fpMatches[strIndex].clear();
-          rpMatches[strIndex].clear();
-          frMatches[strIndex].clear();
-          rrMatches[strIndex].clear();
-          validMotif[strIndex]=0; // no valid motifs found
-          lastHitRecord[strIndex ] = a;
-        }
+      LocusHits &locus = scratch.locusHits[ strIndex ];
+      FlankHits &fpMatches = locus.fpMatches;
+      FlankHits &rpMatches = locus.rpMatches;
+      FlankHits &frMatches = locus.frMatches;
+      FlankHits &rrMatches = locus.rrMatches;
+
+      if (! locus.touched &&
+          orientation < MOTIF) { // clear out the flanks for this STR; it's the first time we've seen this marker (in this read)
+        fpMatches.clear();
+        rpMatches.clear();
+        frMatches.clear();
+        rrMatches.clear();
+        locus.validMotif=false; // no valid motifs found
+        locus.touched=true;
+        touched.push_back(strIndex);
+      }
 
 
 
-        if (orientation == MOTIF || orientation == MOTIF_RC) { // common case
+      if (orientation == MOTIF || orientation == MOTIF_RC) { // common case
           
-          if (lastHitRecord[ strIndex ] == (unsigned) a &&  ! validMotif[strIndex]) {  // we have at least one flank found for this locus for this read
-            // motifs! (currently the strand is ignored, as per the previous str8razor
+        if (locus.touched &&  ! locus.validMotif) {  // we have at least one flank found for this locus for this read
+          // motifs! (currently the strand is ignored, as per the previous str8razor
 
             
-            // we have at least one (valid) forward flank
-            // and not enough reverse flanks
-            if (fpMatches[strIndex].size() > 0 && 
-                rpMatches[strIndex].size() < (*c)[strIndex].reverseCount) {
-              validMotif[strIndex]=1;
-              // match is on the negative strand
-            } else if (rrMatches[strIndex].size() > 0 && 
-                       frMatches[strIndex].size() < (*c)[strIndex].forwardCount) {
-              validMotif[strIndex]=1;
-	    }
-
-	  }
-          // record where the flanks were found, and in which orientation
-        } else if (orientation==FORWARDFLANK) {
+          // we have at least one (valid) forward flank
+          // and not enough reverse flanks
+          if (fpMatches.size() > 0 && 
+              rpMatches.size() < loci.reverseCount[strIndex]) {
+            locus.validMotif=true;
+            // match is on the negative strand
+          } else if (rrMatches.size() > 0 && 
+                     frMatches.size() < loci.forwardCount[strIndex]) {
+            locus.validMotif=true;
+          }
+
+        }
+        // record where the flanks were found, and in which orientation
+      } else if (orientation==FORWARDFLANK) {
           
-          if (! frMatches[strIndex].empty() &&
-              frMatches[strIndex].back()  >= j - (*c)[strIndex].forwardLength) {
+        if (! frMatches.empty() &&
+            frMatches.back()  >= j - loci.forwardLength[strIndex]) {
 	    
-            continue; // overlap!
-          }
+          continue; // overlap!
+        }
 
           
           
-          fpMatches[ strIndex ].push_back(j + (*c)[strIndex].forwardLength); // the index of the first base of the intervening haplotype
-          gotOne=true; 
+        fpMatches.push_back(j + loci.forwardLength[strIndex]); // the index of the first base of the intervening haplotype
+        gotOne=true; 
           
-        } else if (orientation == REVERSEFLANK) {
+      } else if (orientation == REVERSEFLANK) {
           
-          // check to see if this reverse flank that we have is a substring (or overlaps) the forward flank (sadly, this happens. thank you Y chromosome!)
-          // if so, let's skip it
-          if ( ! fpMatches[strIndex].empty() && 
-               fpMatches[strIndex].back()  >= j) {
-            continue;
-          }
+        // check to see if this reverse flank that we have is a substring (or overlaps) the forward flank (sadly, this happens. thank you Y chromosome!)
+        // if so, let's skip it
+        if ( ! fpMatches.empty() && 
+             fpMatches.back()  >= j) {
+          continue;
+        }
           
-          rpMatches[ strIndex ].push_back(j);
-          // if specified, stop the search when we find the first STR that appears correct
-          if (opt.shortCircuit && 
-              rpMatches[ strIndex ].size() == (*c)[strIndex].reverseCount &&
-              fpMatches[ strIndex ].size() == (*c)[strIndex].forwardCount)
-            break;
+        rpMatches.push_back(j);
+        // if specified, stop the search (at this offset) when we find the first STR that appears correct
+        if (opt.shortCircuit && 
+            rpMatches.size() == loci.reverseCount[strIndex] &&
+            fpMatches.size() == loci.forwardCount[strIndex])
+          skipStart = j;
           
-        } else if (orientation == FORWARDFLANK_RC) {
+      } else if (orientation == FORWARDFLANK_RC) {
           
-          // and again, but on the negative strand;
-          // the 2nd flank overlaps the first flank; let's assume that the second match in the overlap is wrong.
-          if (! rrMatches[strIndex].empty() &&
-              rrMatches[strIndex].back()  >= j) {
-            continue;
-          }
+        // and again, but on the negative strand;
+        // the 2nd flank overlaps the first flank; let's assume that the second match in the overlap is wrong.
+        if (! rrMatches.empty() &&
+            rrMatches.back()  >= j) {
+          continue;
+        }
 
-          frMatches[ strIndex ].push_back(j);
-          if (opt.shortCircuit && 
-              rrMatches[ strIndex ].size() == (*c)[strIndex].reverseCount &&
-              frMatches[ strIndex ].size() == (*c)[strIndex].forwardCount)
-            break;
+        frMatches.push_back(j);
+        if (opt.shortCircuit && 
+            rrMatches.size() == loci.reverseCount[strIndex] &&
+            frMatches.size() == loci.forwardCount[strIndex])
+          skipStart = j;
           
           
-        } else if (orientation == REVERSEFLANK_RC) {
+      } else if (orientation == REVERSEFLANK_RC) {
 
 
-          if (! frMatches[strIndex].empty() &&
-              frMatches[strIndex].back()  >= j - (*c)[strIndex].reverseLength) {
+        if (! frMatches.empty() &&
+            frMatches.back()  >= j - loci.reverseLength[strIndex]) {
 	    
-            continue; // overlap!
-          }
+          continue; // overlap!
+        }
 
 
-          rrMatches[ strIndex ].push_back(j + (*c)[strIndex].reverseLength); // the index of the first base of the intervening haplotype
-          gotOne=true; 
+        rrMatches.push_back(j + loci.reverseLength[strIndex]); // the index of the first base of the intervening haplotype
+        gotOne=true; 
           
-          // haven't found a valid motif for this STR yet
-        } 
+        // haven't found a valid motif for this STR yet
+      } 
         
-      }
     } // done reading read
-    dna = records[a].c_str(); // reset the pointer
-    
-    
-    if (gotOne) { // is there at least one record
-      for (unsigned i = 0; i < numStrs; ++i) {
-
-        if (lastHitRecord[i]== (unsigned) a 
-            && validMotif[i]
-            ) { // this STR was found for this read
-          // positive strand match
-
-          if (fpMatches[i].size() == (*c)[i].forwardCount) {
-            if (rpMatches[i].size() == (*c)[i].reverseCount ) {
-              // ensure that if it matches once on the positive strand, it doesn't also match on the negative strand (that both if statements below cannot be true)
-              if ( rrMatches[i].size() != (*c)[i].reverseCount  ||
-                   frMatches[i].size() != (*c)[i].forwardCount ) {
-                
+
+
+    // the loci that this read touched (and they're untouched, for the next read)
+    for (unsigned t = 0; t < touched.size(); ++t) {
+      unsigned i = touched[t];
+      LocusHits &locus = scratch.locusHits[i];
+      locus.touched = false;
+
+      // with -l (and for the reads that -e searched) the motifs are looked for now: after the first flank, and before the mate's (as in the MOTIF case above)
+      if (lazyMotifs && gotOne) {
+        EncodedRead read = batch.read(a);
+        const FlankHits &fp = locus.fpMatches, &rr = locus.rrMatches;
+        locus.validMotif =
+          (! fp.empty() && hasMotif(read, motifStart(fp.front() - loci.forwardLength[i], loci.forwardLength[i], i),
+                                    motifLimit(locus.rpMatches, loci.reverseCount[i], loci.reverseLength[i], stop, i), i)) ||
+          (! rr.empty() && hasMotif(read, motifStart(rr.front() - loci.reverseLength[i], loci.reverseLength[i], i),
+                                    motifLimit(locus.frMatches, loci.forwardCount[i], loci.forwardLength[i], stop, i), i));
+      }
+
+      if (gotOne // is there at least one record
+          && locus.validMotif
+          ) { // this STR was found for this read
+        FlankHits &fpMatches = locus.fpMatches;
+        FlankHits &rpMatches = locus.rpMatches;
+        FlankHits &frMatches = locus.frMatches;
+        FlankHits &rrMatches = locus.rrMatches;
+        // positive strand match
+
+        if (fpMatches.size() == loci.forwardCount[i]) {
+          if (rpMatches.size() == loci.reverseCount[i] ) {
+            // ensure that if it matches once on the positive strand, it doesn't also match on the negative strand (that both if statements below cannot be true)
+            if ( rrMatches.size() != loci.reverseCount[i]  ||
+                 frMatches.size() != loci.forwardCount[i] ) {
+              
 #if DEBUG
-                cerr << c->at(i).locusName << " STR on forward strand " << i << " fpsize " << fpMatches[i].size() <<
-                  " rpsize " << rpMatches[i].size() << endl;
+              cerr << c->at(i).locusName << " STR on forward strand " << i << " fpsize " << fpMatches.size() <<
+                " rpsize " << rpMatches.size() << endl;
 #endif
 	      
-                if (fpMatches[i].back()  < rpMatches[i].front()) {
-                  if (opt.includeAnchors) 
-                    makeRecord(dna, qvals, fpMatches[i].front() - (*c)[i].forwardLength, rpMatches[i].back() + (*c)[i].reverseLength, FORWARDFLANK, i, id);
-                  else
-                    makeRecord(dna, qvals, fpMatches[i].front(), rpMatches[i].back(), FORWARDFLANK, i, id);
-                }
-                
+              if (fpMatches.back()  < rpMatches.front()) {
+                if (opt.includeAnchors) 
+                  makeRecord(dna, qvals, qvalsLen, fpMatches.front() - loci.forwardLength[i], rpMatches.back() + loci.reverseLength[i], FORWARDFLANK, i, id);
+                else
+                  makeRecord(dna, qvals, qvalsLen, fpMatches.front(), rpMatches.back(), FORWARDFLANK, i, id);
               }
               
-            } else if (opt.verbose && rpMatches[i].size() < (*c)[i].reverseCount ) { // not enough matches for the second anchor
-              ++biasCounts[id][i];
             }
-            // negative strand match
+            
+          } else if (opt.verbose && rpMatches.size() < loci.reverseCount[i] ) { // not enough matches for the second anchor
+            ++biasCounts[id][i];
           }
-          if ( rrMatches[i].size() == (*c)[i].reverseCount) {
-            if ( frMatches[i].size() == (*c)[i].forwardCount ) {
-              
+          // negative strand match
+        }
+        if ( rrMatches.size() == loci.reverseCount[i]) {
+          if ( frMatches.size() == loci.forwardCount[i] ) {
+            
 #if DEBUG
-              cerr << c->at(i).locusName << " STR on reverse strand " << i << " fpsize " << fpMatches[i].size() <<
-                " rpsize " << rpMatches[i].size() << endl;
+            cerr << c->at(i).locusName << " STR on reverse strand " << i << " fpsize " << fpMatches.size() <<
+              " rpsize " << rpMatches.size() << endl;
 #endif
-              
-              if (rrMatches[i].back() < frMatches[i].front() ) {
-                if (opt.includeAnchors)
-                  makeRecord(dna, qvals, rrMatches[i].front() - (*c)[i].reverseLength , frMatches[i].back()+(*c)[i].forwardLength, REVERSEFLANK, i, id);
-                else
-                  makeRecord(dna, qvals, rrMatches[i].front(), frMatches[i].back(), REVERSEFLANK, i, id);	      
-              }
-              
-            } else if (opt.verbose && frMatches[i].size() < (*c)[i].forwardCount ) {
-              ++biasCounts[id][i]; 
+            
+            if (rrMatches.back() < frMatches.front() ) {
+              if (opt.includeAnchors)
+                makeRecord(dna, qvals, qvalsLen, rrMatches.front() - loci.reverseLength[i] , frMatches.back()+loci.forwardLength[i], REVERSEFLANK, i, id);
+              else
+                makeRecord(dna, qvals, qvalsLen, rrMatches.front(), frMatches.back(), REVERSEFLANK, i, id);	      
             }
             
+          } else if (opt.verbose && frMatches.size() < loci.forwardCount[i] ) {
+            ++biasCounts[id][i]; 
           }
+          
         }
-      }//for
-    } // gotone
+      }
+    }
+    touched.clear();
   }
   
   
@@ -969,19 +1344,13 @@ findMatchesOneThread() {
 
   bool done=false;
 
-    // a ceiling on the number of matches you can find on a single pass through the trie
-  unsigned *matchIds = new unsigned[ numStrs * 4];
-  unsigned char *matchTypes = new unsigned char[ numStrs * 4];
+  ReadScratch scratch(numStrs);
+  FastqBatch batch; // we're only using one batch...
   
-  records = MEM; // we're only using one of the buffers...
-  qrecords=QMEM;
   while (!done) {
-    done = buffer(MEM, QMEM);
-    processDNA_Trie(0, matchIds, matchTypes);
+    done = buffer(batch);
+    processDNA_Trie(batch, 0, batch.numRecs, 0, scratch);
   }
-    
-  delete [] matchIds;
-  delete [] matchTypes;
 
   printReports(opt.out, matches[0], opt.minPrint,opt.noReverseComplement);
 }
@@ -992,7 +1361,7 @@ void
 usage(char *arg0) {
 
   cerr << "Correct usage for version cstr8 v" << VERSION_NUM << endl << arg0 << " -c configFile [OPTIONS] fastqfile1 [fastqfile2 ... ]" << endl << "OR" << endl << arg0 << " -c configFile [OPTIONS] < fastqfile1" << endl;
-  cerr << endl << "IE, This program takes in standard input, or a bunch of (uncompressed) fastq files\nAnd remember, options are specified *before* the configfile and fastqs (ie, the arguments)" << endl << endl;
+  cerr << endl << "IE, This program takes in standard input, or a bunch of fastq files (uncompressed, or compressed with gzip/bgzip)\nAnd remember, options are specified *before* the configfile and fastqs (ie, the arguments)" << endl << endl;
   cerr << "Possible arguments:" << endl << endl << 
     "\t-h (help; causes this to be printed)" << endl <<
     "\t-d (heaDer; prints a header (column identifiers) to the tsv" << endl <<
@@ -1002,12 +1371,18 @@ usage(char *arg0) {
 
     "\t-a integer (default 1; the maximum Hamming distance used with anchor search. can only be 0, 1 or 2)" << endl <<
     "\t-m integer (default 0; the maximum Hamming distance used with motif search. can only be 0 or 1)" << endl <<
-    "\t-c configFile (REQUIRED; the locus config file used to define the STRs)" << endl << 
+    "\t-l (Lazy motifs; the motifs are only looked for between the anchors of reads that have them, and not at every offset. Motifs can be at most " << MAXWORD/2 << " bases)" << endl <<
+    "\t-k (K-mer prefilter; reads that cannot contain any anchor (within the -a distance) are skipped without being searched. The number skipped is printed to standard error)" << endl <<
+    "\t-e (amplicon mode; the 12-mers of a read tell which anchors it can have, and wherE; only those are checked. Reads with too many such 12-mers are searched in full. The calls are the same. Anchors and motifs can be at most " << MAXWORD/2 << " bases)" << endl <<
+    "\t-c configFile (REQUIRED; the locus config file used to define the STRs. Can also be an index made with --build-index)" << endl << 
     "\t-p integer (The number of processors/cpus used)" << endl <<
+    "\t-b integer (default " << DEFAULTBATCHSIZE << "; the number of fastq records read at a time. With -p, the threads claim " << CHUNKSIZE << " records of a batch at a time)" << endl <<
+    "\t-r integer (default " << BATCHESPERTHREAD << "*the number of processors; with -p, the number of batches (of -b records) kept in memory. The reader can get this far ahead of the threads)" << endl <<
     "\t-q (Uses quality scores. Optional arguments: -q E (uses number of errors expected, per Edgar, sum of error probs) or the default (-q X which is the expected probability of error, taken as product of probabilities that the base is correct )" << endl <<
     "\t-t filter (This filters on Type, e.g. AUTOSOMES; ie, it restricts the output to STRs that have the same type as specified in column 2 of the config file)" << endl <<
     "\t-o filename (This writes the output to filename, as opposed to standard out)" << endl <<
-    "\t-f integer (Min match; this causes haplotypes with less than f occurences to be omitted from the final output file" << endl << endl;
+    "\t-f integer (Min match; this causes haplotypes with less than f occurences to be omitted from the final output file" << endl << 
+    "\t--build-index filename (Writes the config file and the search structure built from it (with the -a, -m, -l and -t given) to filename, and exits.\n\t\tThe index can then be given to -c; this skips building the search structure every time)" << endl << endl;
   exit(EXIT_FAILURE);
 }
 
@@ -1029,7 +1404,13 @@ parseArgs(int argc, char **argv, Options &opt) {
   opt.config=NULL;
   opt.numThreads=1;
   opt.useTrie=1;
+  opt.lazyMotifs=false;
+  opt.prefilter=false;
+  opt.amplicon=false;
   opt.type=NULL;
+  opt.buildIndex=NULL;
+  opt.batchSize=DEFAULTBATCHSIZE;
+  opt.ringDepth=0;
   opt.includeAnchors=false;
   opt.printHeader=false;
   opt.motifDistance=0;
@@ -1050,6 +1431,12 @@ parseArgs(int argc, char **argv, Options &opt) {
         opt.verbose=1;
       } else if (argv[i][1] == 'i') {
         opt.includeAnchors=true;
+      } else if (argv[i][1] == 'l') {
+        opt.lazyMotifs=true;
+      } else if (argv[i][1] == 'k') {
+        opt.prefilter=true;
+      } else if (argv[i][1] == 'e') {
+        opt.amplicon=true;
       } else if (argv[i][1] == 'q') {
         opt.useQuality=EXPECT_QUALITY;
 
@@ -1158,6 +1545,40 @@ parseArgs(int argc, char **argv, Options &opt) {
 #endif
           
         }
+      } else if (argv[i][1] == 'b') { // setting the number of records read at a time
+        if (i == argc-1) {
+          cerr << endl << "Option -b requires a positive integer; the number of fastq records in a batch" << endl << endl;
+          errors=1;
+        } else {
+          ++i;
+          char *s = argv[i];
+          opt.batchSize=0;
+          while (*s >= '0' && *s <= '9') {
+            opt.batchSize = (opt.batchSize*10)+(*s - '0');
+            ++s;
+          }
+          if (s == argv[i] || opt.batchSize == 0) {
+            cerr << endl << "Option -b requires a positive integer; not " << argv[i]  << endl << endl;
+            errors=1;
+          }
+        }
+      } else if (argv[i][1] == 'r') { // setting the number of batches in memory
+        if (i == argc-1) {
+          cerr << endl << "Option -r requires a positive integer; the number of batches of fastq records kept in memory" << endl << endl;
+          errors=1;
+        } else {
+          ++i;
+          char *s = argv[i];
+          opt.ringDepth=0;
+          while (*s >= '0' && *s <= '9') {
+            opt.ringDepth = (opt.ringDepth*10)+(*s - '0');
+            ++s;
+          }
+          if (s == argv[i] || opt.ringDepth == 0) {
+            cerr << endl << "Option -r requires a positive integer; not " << argv[i]  << endl << endl;
+            errors=1;
+          }
+        }
       } else if (argv[i][1] == 'c') { // this config file
         if (i == argc-1) {
           cerr << endl<< "Option -c requires a file; ie, the config file" << endl << endl;
@@ -1166,6 +1587,14 @@ parseArgs(int argc, char **argv, Options &opt) {
           ++i;
           opt.config = argv[i];
         }
+      } else if (strcmp(argv[i], "--build-index") == 0) { // precompiles the trie
+        if (i == argc-1) {
+          cerr << endl<< "Option --build-index requires a file; ie, where the index is written to" << endl << endl;
+          errors=1;
+        } else {
+          ++i;
+          opt.buildIndex = argv[i];
+        }
       } else if (argv[i][1] == '-') { // unix convention; force the end of flags
         break;
       } else {
@@ -1196,115 +1625,107 @@ workerThread(void *arg) {
   
   int id =  *((int*)arg ); // thread id
 
-  unsigned *matchIds = NULL;
-  unsigned char *matchTypes = NULL;
-  matchIds = new unsigned[ numStrs * 4];
-  matchTypes = new unsigned char[ numStrs * 4];
-
-
- top:
-  // spin loop... wait for the producer to generate some data
-  while (workersWorking < opt.numThreads) 
-    ;
+  ReadScratch scratch(numStrs);
 
- middle:
+  while (1) {
+    uint64_t claim = cursor.fetch_add(CHUNKSIZE); // the next chunk is ours
+    unsigned long b = claim >> 32;
+    unsigned start = claim & UINT_MAX;
 
-  ++startedWorking;
-  processDNA_Trie(id, matchIds, matchTypes);
+    // wait for the reader to fill the batch (or to find that there's no such batch)
+    batchReady.wait([b]() { return batchesRead > b || done; });
+    if (batchesRead <= b)
+      return NULL;
 
-  if (done) {
+    RingSlot &slot = ring[ b % opt.ringDepth ];
+    unsigned numRecs = slot.batch.numRecs;
+    long claims = 0;
 
-    if (opt.useTrie) {
-      delete [] matchIds;
-      delete [] matchTypes;
-    }
-
-    return NULL;
-  }
-
-  while (startedWorking < opt.numThreads)
-    ;
-
-  pthread_mutex_lock(&ioLock);
-
-  --workersWorking;
-
-  // last worker to check in
-  if (workersWorking == 0) {    
-
-    while (! buffered) //ensure that the other buffer is filled... 
-      ; // ie, wait for buffered=1 assignment
-
-    startedWorking=0;
-    // swap the pointers...
-    if (records==MEM) {
-      records = OTHERMEM;
-      qrecords = OTHERQMEM;
+    if (start < numRecs) {
+      processDNA_Trie(slot.batch, start, min(start + CHUNKSIZE, numRecs), id, scratch);
     } else {
-      records = MEM;
-      qrecords = QMEM;
+      // the batch has been handed out; move the cursor to the next batch (unless someone beat us to it)
+      // the claims on this batch are then final
+      uint64_t c = cursor;
+      while ((c >> 32) == b) {
+        if (cursor.compare_exchange_weak(c, (uint64_t)(b + 1) << 32)) {
+          claims = (c & UINT_MAX) / CHUNKSIZE;
+          break;
+        }
+      }
     }
-    
-    buffered=0; // we set buffered=0; ie, the other buffer needs to get filled
 
-    if (nextdone)
-      done = true; // update done with the status of the current buffer
-#ifdef OSX
-    if (sem_post(writersLock)) { // wake up the writer thread which fills the buffer (Named semaphore)
-      cerr << "Error waking up writer\n";
-    }
-#else
-    if (sem_post(&writersLock)) { // wake up the writer thread which fills the buffer (unnamed semaphore)
-      cerr << "Error waking up writer\n";
+    // the last one out lets the reader reuse the batch
+    if (slot.pending.fetch_add(claims - 1) + claims - 1 == 0) {
+      slot.full = false;
+      slotFree.wake();
     }
-#endif
-    workersWorking= opt.numThreads; // wake up the othe readers
-    pthread_mutex_unlock(&ioLock);  // release mutex
-    goto middle;
-  } else {
-    pthread_mutex_unlock(&ioLock);
-    goto top;
   }
 
+  return NULL;
 }
 
 
 void *
 writerThread(void *arg) {
-  
-  done=buffer(MEM, QMEM); // read in a bunch of data
-  if (done)
-    nextdone = true;
 
-  records = MEM; // set up the pointer
-  qrecords=QMEM;
-  
-  workersWorking= opt.numThreads; // let the workers start processing the data
+  unsigned long b;
+  for (b=0 ; ; ++b) {
+    RingSlot &slot = ring[ b % opt.ringDepth ];
 
-  unsigned i=0;
-  while (! nextdone) {
-    ++i;
+    // wait for the workers to finish with this batch
+    slotFree.wait([&slot]() { return ! slot.full; });
 
-    if (records == MEM) 
-      nextdone=buffer(OTHERMEM, OTHERQMEM);
-    else 
-      nextdone=buffer(MEM, QMEM);
+    bool last = buffer(slot.batch); // read in a bunch of data
+    slot.pending = 0;
+    slot.full = true;
+    ++batchesRead; // let the workers have it
+    batchReady.wake();
 
-    buffered=1; // the double buffer is set up
+    if (last)
+      break;
+  }
 
-    if (nextdone) {
-      break; // no sense waiting...
-    }
+  done = true;
+  batchReady.wake();
+  return NULL;
+}
 
-#ifdef OSX
-    sem_wait(writersLock); // wait for the readers to finish reading *records
-#else
-    sem_wait(&writersLock); // wait for the readers to finish reading *records
-#endif
+// processes the current input with opt.numThreads workers (and a reader)
+void
+findMatchesMT(int *ids) {
+  int err;
+  pthread_t t;
+  list <pthread_t> threads;
+
+  batchesRead = 0;
+  cursor = 0;
+  done = false;
+
+  err = pthread_create(&t, NULL, writerThread, NULL ); 
+  if (err) {
+    cerr << "Error creating writer thread" << endl;
+    exit(EXIT_FAILURE);
   }
+  threads.push_back(t);
 
-  return NULL;
+  for (int j=0; j < opt.numThreads; ++j) {
+    err = pthread_create(&t, NULL, workerThread, (void*) &(ids[j]) ); 
+    if (err) {
+      cerr << "Error creating thread number: " << j << endl;
+      exit(EXIT_FAILURE);
+    }
+    threads.push_back(t);
+  }
+  for (list<pthread_t>::iterator itr = threads.begin(); itr != threads.end(); ++itr) { // collect the threads when we're done
+    t = *itr;
+    pthread_join(t, NULL);
+  }
 
+  threads.clear();
+  std::ios::sync_with_stdio(true);
+  printReportsMT(opt.out, ids);
+  std::ios::sync_with_stdio(false);
 }
 
 #endif
@@ -1320,11 +1741,6 @@ main(int argc, char **argv) {
 
   unsigned i;
 
-#ifdef OSX // for the named semaphores required by OSX
-  char buff[100];
-  sprintf(buff, "%ld", (long)getpid() );
-#endif
-
 
   int start = parseArgs(argc, argv, opt);
 
@@ -1348,12 +1764,30 @@ main(int argc, char **argv) {
   
   std::ios::sync_with_stdio(false);
   
-  // parse the config file
-  c = parseConfig(opt.config, &numStrs, opt.type);
+  trie = new Trie;
+  // parse the config file (or map in the index, which has the trie already built)
+  bool indexed = isIndexFile(opt.config);
+  if (indexed) {
+    IndexSettings settings;
+    c = loadIndex(opt.config, &numStrs, trie, &settings);
+    opt.distance = settings.distance;
+    opt.motifDistance = settings.motifDistance;
+    if (opt.lazyMotifs && ! settings.lazyMotifs)
+      cerr << "The -l option is ignored with an index that was built without it" << endl;
+    opt.lazyMotifs = settings.lazyMotifs;
+    if (opt.type != NULL)
+      cerr << "The -t filter is ignored with an index (the index keeps the filter it was built with)" << endl;
+  } else {
+    c = parseConfig(opt.config, &numStrs, opt.type);
+  }
 
   biasCounts = new unsigned* [ opt.numThreads]; // and counts for partial allelic dropout  
   totalCounts = new unsigned* [ opt.numThreads]; // and counts for partial allelic dropout  
 
+  invalidReads = new unsigned long[ opt.numThreads ]();
+  filteredReads = new unsigned long[ opt.numThreads ]();
+  rejectedReads = new unsigned long[ opt.numThreads ]();
+
   leftFlankPosSum = new unsigned long* [ opt.numThreads]; // and counts for partial allelic dropout  
   rightFlankPosSum = new unsigned long* [ opt.numThreads]; // and counts for partial allelic dropout  
 
@@ -1402,134 +1836,91 @@ main(int argc, char **argv) {
   }
 
 
-  trie = new Trie;
-  trie->makeTrieFromConfig(c, numStrs, opt.distance, opt.motifDistance);
-    
+  loci.build(*c, numStrs);
+  if ((opt.lazyMotifs || opt.amplicon) && ! loci.buildMotifs(*c, numStrs)) {
+    cerr << "Sorry, motifs longer than " << MAXWORD/2 << " bases cannot be used with -l (or -e)" << endl;
+    return 1;
+  }
 
-#ifndef NOTHREADS
-  if (opt.numThreads > 1) {
-    if (pthread_mutex_init(&ioLock, 0)) {
-      cerr << "Failed to init mutex..." << endl;
-    }
-    /* unnamed semaphore. not supported on OSX! */
-#ifdef OSX
-    writersLock = sem_open( buff , O_CREAT, 0600, 0);
-#else
-    if (sem_init(&writersLock, 0, 0)) {
-      cerr << "Failed to init semaphore..." << endl;
+  if (! indexed)
+    trie->makeTrieFromConfig(c, numStrs, opt.distance, opt.motifDistance, ! opt.lazyMotifs);
+
+  if (opt.buildIndex != NULL) {
+    IndexSettings settings;
+    settings.distance = opt.distance;
+    settings.motifDistance = opt.motifDistance;
+    settings.lazyMotifs = opt.lazyMotifs;
+    if (! writeIndex(opt.buildIndex, c, numStrs, trie, settings)) {
+      cerr << "Failed to write the index to " << opt.buildIndex << endl;
       return 1;
     }
-#endif
+    return 0;
+  }
+
+  if (opt.prefilter)
+    prefilter.build(*c, numStrs, opt.distance);
 
+  if (opt.amplicon && ! amplicons.build(*c, numStrs, opt.distance)) {
+    cerr << "Sorry, anchors longer than " << MAXWORD/2 << " bases cannot be used with -e" << endl;
+    return 1;
+  }
     
 
+#ifndef NOTHREADS
+  if (opt.numThreads > 1) {
+    if (opt.ringDepth == 0)
+      opt.ringDepth = BATCHESPERTHREAD * opt.numThreads;
+    ring = new RingSlot[ opt.ringDepth ];
+    for (i=0; i < opt.ringDepth; ++i) {
+      ring[i].full = false;
+      ring[i].pending = 0;
+    }
   }
 #endif
 
   
   for (i=start ; i < (unsigned)argc; ++i) {
-    ifstream in;
-    in.open(argv[i], ios::in);
-    if (! in.is_open() ) {
+    // plain files are memory-mapped; gzipped files are decompressed by other threads
+    if (! reader.open(argv[i], opt.numThreads) ) {
       cerr << "Failed to open " << argv[i] << " for reading\n";
       continue;
     }
-    currentInputStream = &in;
 
 
     if (opt.numThreads < 2) 
       findMatchesOneThread(  );
     else {
 #ifndef NOTHREADS
-      int err;
-      pthread_t t;
-      list <pthread_t> threads;
-            
-      err = pthread_create(&t, NULL, writerThread, NULL ); 
-      if (err) {
-        cerr << "Error creating writer thread" << endl;
-        exit(EXIT_FAILURE);
-      }
-      threads.push_back(t);
-
-      for (int j=0; j < opt.numThreads; ++j) {
-        err = pthread_create(&t, NULL, workerThread, (void*) &(ids[j]) ); 
-        if (err) {
-          cerr << "Error creating thread number: " << j << endl;
-          exit(EXIT_FAILURE);
-        }
-        threads.push_back(t);
-      }
-      for (list<pthread_t>::iterator itr = threads.begin(); itr != threads.end(); ++itr) { // collect the threads when we're done
-        t = *itr;
-        pthread_join(t, NULL);
-      }
-
-      threads.clear();
-      std::ios::sync_with_stdio(true);
-      printReportsMT(opt.out);
-      std::ios::sync_with_stdio(false);
+      findMatchesMT(ids);
 #endif
 
     }
-    in.close();
+    reader.close();
+    reportInvalidReads(argv[i]);
+    reportRejectedReads(argv[i]);
   }
 
   // if no fastq files are given then check stdin
   if (argc == start)  {
 
-    currentInputStream = &cin;
+    reader.openStdin();
     if (opt.numThreads < 2) 
       findMatchesOneThread(  );
 
     else {
 #ifndef NOTHREADS
-      int err;
-      pthread_t t;
-      list <pthread_t> threads;
-            
-      err = pthread_create(&t, NULL, writerThread, NULL ); 
-      if (err) {
-        cerr << "Error creating writer thread" << endl;
-        exit(EXIT_FAILURE);
-      }
-      threads.push_back(t);
-      
-      for (int j=0; j < opt.numThreads; ++j) {
-        err = pthread_create(&t, NULL, workerThread, (void*) &ids[j] ); 
-        if (err) {
-          cerr << "Error creating thread number: " << j << endl;
-          exit(EXIT_FAILURE);
-        }
-        threads.push_back(t);
-      }
-      for (list<pthread_t>::iterator itr = threads.begin(); itr != threads.end(); ++itr) { // collect the threads when we're done
-        t = *itr;
-        pthread_join(t, NULL);
-      }
-
-      threads.clear();
-      std::ios::sync_with_stdio(true);
-      printReportsMT(opt.out);
-      std::ios::sync_with_stdio(false);
+      findMatchesMT(ids);
 #endif
 
     }
+    reportInvalidReads("standard in");
+    reportRejectedReads("standard in");
 
   }
 
 
 #ifndef NOTHREADS
-  if (opt.numThreads > 1) {
-    pthread_mutex_destroy(&ioLock);
-
-#ifdef OSX
-    sem_unlink(buff);
-#else
-    sem_destroy(&writersLock);
-#endif
-
-  }
+  delete[] ring;
 #endif
 
   // let's close our file handles, shall we?
@@ -42,6 +42,7 @@ void freeConfig(Config *c);
 // eg, AUTOSOMES
 vector<Config>* parseConfig(char *file, unsigned *numStrs, char *filt);
 
-char *revcompCstring(const char *dna, int len);
+// reverse complements the len characters of dna into revcompd (and 0-terminates it)
+char *revcompCstring(const char *dna, int len, char *revcompd);
 
 #endif
@@ -25,6 +25,9 @@ SOFTWARE.
 
 #include <iostream>
 #include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <cstring>
 
 #include "constants.h"
 #include "trie.h"
@@ -33,167 +36,288 @@ SOFTWARE.
 
 using namespace std;
 
-/*
-  Takes in a binaryword w of length wordLen
-  and it returns the number of prefixes (anchors) that match;
-  ie, if the anchor added in addWord is a prefix of w
-  The IDs of these matches are added to *out, ordered by the length of the prefix match (length is not recorded)
- */
-
 Trie::Trie() {
-  root=NULL;
-  numNodes=0;
+  mem=NULL;
+  ownsMem=true;
+  matchPool=NULL;
+  bulk=NULL;
+  initMem(0);
+}
+
+
+// the index of the child associated with letter c
+// (anything that's not A, C or G is treated as a T)
+static inline unsigned
+letterIndex(char c) {
+  if (c == 'A')
+    return 0;
+  else if (c == 'C')
+    return 1;
+  else if (c == 'G')
+    return 2;
+  return 3;
 }
 
 
+// whether or not child is a child of parent in the trie (and not a transition made from the failure links)
+inline bool
+Trie::isChild(const TrieNode *parent, uint32_t child) {
+  return child != TRIEROOT && mem[child].depth == parent->depth + 1;
+}
+
+
+// hits are generated by their end position; this restores the (start, length) order
+// insertion sort is used as the list is nearly sorted (a hit moves back by at most the longest word in the trie)
+// and it's stable, so hits from the same node keep the order they were added in
+static void
+sortHits(vector<TrieHit> &hits) {
+  unsigned i, k, n = hits.size();
+  TrieHit hit;
+
+  for (i=1; i < n; ++i) {
+    hit = hits[i];
+    for (k=i; k > 0 &&
+           (hits[k-1].pos > hit.pos ||
+            (hits[k-1].pos == hit.pos && hits[k-1].len > hit.len)); --k)
+      hits[k] = hits[k-1];
+    hits[k] = hit;
+  }
+}
+
+/*
+  Single-pass (Aho-Corasick) search of the read.
+  Every word in the trie that occurs in the read is written to hits
+  The hits are sorted by start position and then by length (hits with the same start and length are in the order they were added to the trie)
+  The read is searched in runs of unambiguous bases; the search starts over (at the root) after each ambiguous base
+  makeFailureLinks must be called first.
+ */
 unsigned
-Trie::findPrefixMatch(const char *w, unsigned wordLen, unsigned *outId, unsigned char *outType) {
-  unsigned i, numHits=0;
-  
-  char c;
-  TrieNode *parent, *child;
-  parent = root;
-  
-  // traverse the tree, 
-  for (i=0; i < wordLen && *w; ++i, ++w) {
+Trie::findAllMatches(const EncodedRead &read, vector<TrieHit> &hits) {
+  findAllMatches(&read, 1, &hits);
+  return hits.size();
+}
 
-    if (parent->id != NULL) {
-      int size = parent->id->size();
-      for ( int i = 0; i < size; ++i) {
-	++numHits;
-	*outType++ = parent->type->at(i);
-	*outId++ = parent->id->at(i);
-      }
-    }
+// where a read is in the (batched) search
+struct TrieCursor {
+  unsigned read; // which read
+  unsigned pos; // the number of bases consumed
+  unsigned end; // the next ambiguous base (or the end of the read)
+  uint32_t state; // the node reached after pos bases. its matches have not been reported yet
+};
 
+/*
+  findAllMatches, for numReads reads at once (the hits of reads[i] go in hits[i])
+  Each step of the search is a load of a node that is (most likely) not in the cache, and depends on the load before it
+  so TRIECURSORS reads are searched in lockstep; each cursor prefetches its next node, and the node is used on the next round
+  (after the other cursors have taken their step). When a read is done, its cursor takes the next read
+ */
+void
+Trie::findAllMatches(const EncodedRead *reads, unsigned numReads, vector<TrieHit> *hits) {
+  TrieCursor cursors[TRIECURSORS];
+  unsigned numCursors = 0, nextRead = 0, c;
+  uint32_t match;
+  TrieHit hit;
+
+  for (c=0; c < numReads; ++c)
+    hits[c].clear();
+
+  while (numCursors || nextRead < numReads) {
+
+    // give the idle cursors a read
+    while (numCursors < TRIECURSORS && nextRead < numReads) {
+      TrieCursor &cur = cursors[numCursors++];
+      cur.read = nextRead++;
+      cur.pos = 0;
+      cur.end = nextAmbiguous(reads[cur.read], 0);
+      cur.state = TRIEROOT;
+    }
 
-    c = *w;
-    if (c == 'A') {
-      if (parent->a == NULL) {
-	return numHits;
-      }
-      child = parent->a;
-    } else if (c == 'C') {
-      if (parent->c == NULL) {
-	return numHits;
-      }
-      child = parent->c;
-    } else if (c == 'G') {
-      if (parent->g == NULL) {
-	return numHits;
+    for (c=0; c < numCursors; ) {
+      TrieCursor &cur = cursors[c];
+      const EncodedRead &read = reads[cur.read];
+      const TrieNode *node = mem + cur.state; // (prefetched last round)
+
+      // the anchors/motifs that end at this base
+      // the output links are ordered longest -> shortest; ie, by increasing start position
+      match = node->numMatches ? cur.state : node->out;
+      while (match != TRIEROOT) {
+        const TrieNode *m = mem + match;
+        const TrieMatch *t = matchPool + m->matches;
+        hit.len = m->depth;
+        hit.pos = cur.pos - hit.len;
+        for (unsigned j = 0; j < m->numMatches; ++j, ++t) {
+          hit.id = t->id;
+          hit.type = t->type;
+          hits[cur.read].push_back(hit);
+        }
+        match = m->out;
       }
-      child = parent->g;
-    } else {
-      if (parent->t == NULL) {
-	return numHits;
+
+      if (cur.pos == cur.end) {
+        if (cur.pos >= read.len) { // this read is done
+          sortHits(hits[cur.read]);
+          cursors[c] = cursors[--numCursors];
+          continue;
+        }
+        // nothing matches across the ambiguous base; start over after it
+        cur.state = TRIEROOT;
+        cur.end = nextAmbiguous(read, ++cur.pos);
+      } else {
+        // (the failure links are built into the transitions)
+        cur.state = node->child[ read.codes[cur.pos++] ];
+        __builtin_prefetch(mem + cur.state);
       }
-      child = parent->t;
+      ++c;
     }
-    
-    parent = child;
   }
+}
 
-  // this is a corner case....
-  // the entire binaryword matches the entire anchor sequence
 
-  if (parent->id != NULL) {
-    int size = parent->id->size();
-    for ( int i = 0; i < size; ++i) {
-      ++numHits;
-      *outType++ = parent->type->at(i);
-      *outId++ = parent->id->at(i);
+/*
+  Computes the failure links (and the output links) of the trie (breadth-first)
+  The failure link of a node is the node that represents the longest proper suffix of its word
+  and the output link is the first node with an anchor/motif that is reachable by failure links
+  The missing children are then filled in with where the failure links lead (ie, child[] becomes the full transition table)
+  so the search takes exactly one step per base. A real child is one level deeper than its parent (see isChild)
+ */
+void
+Trie::makeFailureLinks() {
+  
+  unsigned i, j;
+  vector<uint32_t> queue;
+  uint32_t parent, child, f;
+
+  mem[TRIEROOT].fail = TRIEROOT;
+  mem[TRIEROOT].out = TRIEROOT;
+  mem[TRIEROOT].depth = 0;
+  queue.reserve(lastNode + 1);
+  queue.push_back(TRIEROOT);
+
+  for (i=0; i < queue.size(); ++i) {
+    parent = queue[i];
+    for (j=0; j < 4; ++j) {
+      child = mem[parent].child[j];
+      // where the search goes from here on letter j, if this node does not have that child
+      // (the failure link is shallower, so its transitions are already complete)
+      f = parent == TRIEROOT ? TRIEROOT : mem[ mem[parent].fail ].child[j];
+      if (child == TRIEROOT) {
+        mem[parent].child[j] = f;
+        continue;
+      }
+
+      mem[child].depth = mem[parent].depth + 1;
+      mem[child].fail = f;
+
+      f = mem[child].fail;
+      mem[child].out = mem[f].numMatches ? f : mem[f].out;
+      queue.push_back(child);
     }
   }
-
-  return numHits;
 }
 
 
-
-
 bool
 Trie::existsPrefixMatch(const char *w, unsigned wordLen, unsigned outId, unsigned char outType) {
 
   unsigned i;
-  char c;
-  TrieNode *parent, *child;
-  parent = root;
+  uint32_t child;
+  TrieNode *parent = mem;
   
   // traverse the tree, 
   for (i=0; i < wordLen && *w; ++i, ++w) {
 
-    if (parent->id != NULL) {
-      int size = parent->id->size();
-      for ( int i = 0; i < size; ++i) {
-	if ( parent->type->at(i) == outType &&
-	     parent->id->at(i) == outId)
-	  return true;
-      }
+    const TrieMatch *m = matchPool + parent->matches;
+    for (unsigned j = 0; j < parent->numMatches; ++j, ++m) {
+      if ( m->type == outType &&
+           m->id == outId)
+        return true;
     }
 
-
-    c = *w;
-    if (c == 'A') {
-      if (parent->a == NULL) {
-	return false;
-      }
-      child = parent->a;
-    } else if (c == 'C') {
-      if (parent->c == NULL) {
-	return false;
-      }
-      child = parent->c;
-    } else if (c == 'G') {
-      if (parent->g == NULL) {
-	return false;
-      }
-      child = parent->g;
-    } else {
-      if (parent->t == NULL) {
-	return false;
-      }
-      child = parent->t;
-    }
+    child = parent->child[ letterIndex(*w) ];
+    if (! isChild(parent, child))
+      return false;
     
-    parent = child;
+    parent = mem + child;
   }
 
   // this is a corner case....
   // the entire binaryword matches the entire anchor sequence
 
-  if (parent->id != NULL) {
-    int size = parent->id->size();
-    for ( int i = 0; i < size; ++i) {
-	if ( parent->type->at(i) == outType &&
-	     parent->id->at(i) == outId)
-	  return true;
-    }
+  const TrieMatch *m = matchPool + parent->matches;
+  for (unsigned j = 0; j < parent->numMatches; ++j, ++m) {
+    if ( m->type == outType &&
+         m->id == outId)
+      return true;
   }
 
   return false;
 }
 
 
-// this allocates the memory for the trie
-// AND it initializes the nodes to NULL
+// this (re)starts the trie with just the root
+// if num_nodes is given, that's exactly how many nodes the trie can have (one array)
+// otherwise the trie grows as needed (in chunks)
 void
 Trie::initMem(unsigned num_nodes) {
-  
-  unsigned i;
-  mem = new TrieNode[num_nodes];
-  TrieNode *head = mem;
-  for (i=0; i < num_nodes; ++i, ++head) {
-    (*head).a =     (*head).c =    (*head).g =     (*head).t = NULL;
-    (*head).id = NULL;
-    (*head).type = NULL;
-  }
+
+  freeMem();
+  if (num_nodes) 
+    mem = (TrieNode*) calloc(num_nodes, sizeof(TrieNode));
+  else
+    chunks.push_back( (TrieNode*) calloc(TRIECHUNK, sizeof(TrieNode)) );
 
   numNodes = num_nodes;
-  root = mem;
-  
+  lastNode = TRIEROOT;
+  vector< pair<uint32_t, TrieMatch> >().swap(pending);
+}
+
+void
+Trie::freeMem() {
+  for (unsigned i=0; i < chunks.size(); ++i)
+    free(chunks[i]);
+  chunks.clear();
+
+  if (ownsMem)
+    free(mem);
+  mem = NULL;
+  ownsMem = true;
+  pool.clear();
+  matchPool = NULL;
 }
 
 
+/*
+  Makes the trie use nodes and matches that were made (and pack'd) elsewhere
+  eg, a precompiled index that was mapped into memory. The memory is not freed by the trie.
+ */
+void
+Trie::attach(const TrieNode *nodes, unsigned num_nodes, const TrieMatch *matches) {
+  freeMem();
+  mem = (TrieNode*) nodes; // the searches don't write to mem
+  ownsMem = false;
+  numNodes = num_nodes;
+  lastNode = num_nodes - 1;
+  matchPool = matches;
+}
+
+
+// w/o a fixed size, nodes are handed out from fixed-size chunks
+// (calloc'd, so untouched nodes don't take up any physical memory)
+uint32_t
+Trie::addNode() {
+  ++lastNode;
+  if (mem != NULL) {
+    if (lastNode >= numNodes) {
+      cerr << "Error with the maths. Email the author (August) to fix this!" << endl;
+      exit(1);
+    }
+  } else if ((lastNode & (TRIECHUNK-1)) == 0) {
+    chunks.push_back( (TrieNode*) calloc(TRIECHUNK, sizeof(TrieNode)) );
+  }
+
+  return lastNode;
+}
+
 
 // nonrecursive implementation;
 // it takes in a word of length wordLen
@@ -205,140 +329,251 @@ Trie::initMem(unsigned num_nodes) {
 void
 Trie::addWord(const char *w, unsigned wordLen, unsigned id, unsigned char type) {
   
-  unsigned i;
-  char c;
-  TrieNode *parent, *child;
-  parent = root;
-
-  //  cout << w << "\t" << mem - root << "\t";
+  unsigned i, letter;
+  uint32_t parent = TRIEROOT;
+  TrieMatch m;
+
+  if (bulk != NULL) { // the word is added later (bulkLoad)
+    TrieWord b;
+    b.w = gatcToLong((char*)w, wordLen);
+    b.len = wordLen;
+    b.seq = bulk->size();
+    b.id = id;
+    b.type = type;
+    bulk->push_back(b);
+    return;
+  }
 
   // traverse the tree, allocing as needed
   for (i=0; i < wordLen && *w; ++i, ++w) {
-    c = *w;
-    if (c == 'A') {
-      if (parent->a == NULL) {
-	parent->a = ++mem;
-      }
-      child = parent->a;
-    } else if (c == 'C') {
-      if (parent->c == NULL) {
-	parent->c = ++mem;
-      }
-      child = parent->c;
-    } else if (c == 'G') {
-      if (parent->g == NULL) {
-	parent->g = ++mem;
-      }
-      child = parent->g;
-    } else {
-      if (parent->t == NULL) {
-	parent->t = ++mem;
-      }
-      child = parent->t;
-    }
-    
-    parent = child;
-  }
+    letter = letterIndex(*w);
+    if (node(parent).child[letter] == TRIEROOT) 
+      node(parent).child[letter] = addNode();
 
-  if (parent->id == NULL) {
-    parent->id = new vector<unsigned>;
-    parent->type = new vector<unsigned char>;
-    parent->id->push_back(id);
-    parent->type->push_back(type);
-  } else {
-    // ensure that each type/id pair is only added once    
-    for (i=0; i < parent->id->size(); ++i) {
-      if (parent->id->at(i) == id &&
-          parent->type->at(i) == type)
-        return;
-    }
+    parent = node(parent).child[letter];
+  }
 
-    parent->id->push_back(id);
-    parent->type->push_back(type);    
+  // duplicates are removed in pack
+  m.id = id;
+  m.type = type;
+  pending.push_back( make_pair(parent, m) );
+}
 
+// this adds the reverse complement of a word to the trie
 
+void
+Trie::addWordRC(const char *w, unsigned wordLen, unsigned id, unsigned char type) {
+  
+  unsigned i, letter;
+  uint32_t parent = TRIEROOT;
+  TrieMatch m;
+
+  if (bulk != NULL) {
+    TrieWord b;
+    binaryword forward = gatcToLong((char*)w, wordLen);
+    reverseComplement(&forward, &(b.w), wordLen);
+    b.len = wordLen;
+    b.seq = bulk->size();
+    b.id = id;
+    b.type = type;
+    bulk->push_back(b);
+    return;
   }
 
+  // traverse the tree, allocing as needed
+  for (i=wordLen; i > 0; --i) {
+    letter = 3 - letterIndex(w[i-1]); // A<->T and C<->G
 
-  
+    if (node(parent).child[letter] == TRIEROOT) 
+      node(parent).child[letter] = addNode();
+
+    parent = node(parent).child[letter];
+  }
+
+  m.id = id;
+  m.type = type;
+  pending.push_back( make_pair(parent, m) );
 }
 
-// this adds the reverse complement of a word to the trie
 
+// the number of leading bases that two (bulk) words have in common
+static inline unsigned
+sharedPrefix(const TrieWord &a, const TrieWord &b) {
+  binaryword x = a.w ^ b.w;
+  unsigned n = x ? __builtin_clzll(x) / 2 : MAXWORD/2;
+  return min(n, (unsigned) min(a.len, b.len));
+}
+
+/*
+  Builds the trie from a list of words (from addWord/addWordRC with bulk set)
+  Once sorted, a word shares a prefix with the previous word (those nodes are already in the trie)
+  so every word is added by only creating the nodes past that prefix; there are no walks from the root
+  and the number of nodes is known before anything is allocated.
+ */
 void
-Trie::addWordRC(const char *w, unsigned wordLen, unsigned id, unsigned char type) {
+Trie::bulkLoad(vector<TrieWord> &words) {
+
+  unsigned i, d, n, shared;
+  uint32_t path[ MAXWORD/2 + 1 ]; // the nodes along the previous word
+  TrieMatch m;
+
+  sort(words.begin(), words.end());
+
+  n = 1;
+  for (i=0; i < words.size(); ++i) {
+    shared = i ? sharedPrefix(words[i-1], words[i]) : 0;
+    n += words[i].len - shared;
+  }
+
+  initMem(n);
+  pending.reserve(words.size());
+  path[0] = TRIEROOT;
   
-  unsigned i;
-  char c;
-  TrieNode *parent, *child;
-  parent = root;
+  for (i=0; i < words.size(); ++i) {
+    const TrieWord &word = words[i];
+    shared = i ? sharedPrefix(words[i-1], word) : 0;
+    for (d = shared; d < word.len; ++d) {
+      path[d+1] = addNode();
+      mem[ path[d] ].child[ (word.w >> (MAXWORD - 2 - d - d)) & 3 ] = path[d+1];
+    }
 
-  //  cout << w << "\t" << mem - root << "\t";
+    m.id = word.id;
+    m.type = word.type;
+    pending.push_back( make_pair(path[word.len], m) );
+  }
+}
 
-  // traverse the tree, allocing as needed
-  for (i=wordLen; i > 0; --i) {
-    c = w[i-1];
 
-    if (c == 'A') {
-      if (parent->t == NULL) {
-        parent->t = ++mem;
-      }
-      child = parent->t;
+// used to group the pending matches by node (the sort is stable, so the insertion order is kept within a node)
+static bool
+byNode(const pair<uint32_t, TrieMatch> &a, const pair<uint32_t, TrieMatch> &b) {
+  return a.first < b.first;
+}
 
-    } else if (c == 'C') {
-      if (parent->g == NULL) {
-        parent->g = ++mem;
-      }
-      child = parent->g;
-    } else if (c == 'G') {
-      if (parent->c == NULL) {
-        parent->c = ++mem;
+/*
+  This finishes the trie (no words can be added after this)
+  The nodes are moved from the chunks into one array of exactly the right size 
+  and the matches (from addWord/addWordRC) are written to the match pool; the matches of a node are contiguous
+  ensures that each type/id pair is only added once (per node)
+ */
+void
+Trie::pack() {
+
+  unsigned i, j, first, numChunks = chunks.size();
+  size_t n;
+
+  if (mem == NULL) { // built in chunks; copy them into one array
+    numNodes = lastNode + 1;
+    mem = (TrieNode*) malloc((size_t)numNodes * sizeof(TrieNode));
+    for (i=0; i < numChunks; ++i) {
+      n = min((size_t)TRIECHUNK, (size_t)numNodes - (size_t)i*TRIECHUNK);
+      memcpy(mem + (size_t)i*TRIECHUNK, chunks[i], n*sizeof(TrieNode));
+      free(chunks[i]);
+    }
+    chunks.clear();
+  }
+
+  // (bulkLoad adds them in node order already)
+  if (! is_sorted(pending.begin(), pending.end(), byNode))
+    stable_sort(pending.begin(), pending.end(), byNode);
+
+  pool.clear();
+  pool.reserve(pending.size());
+  for (i=0; i < pending.size(); ) {
+    TrieNode *node = mem + pending[i].first;
+    first = pool.size();
+    node->matches = first;
+
+    for ( ; i < pending.size() && mem + pending[i].first == node; ++i) {
+      const TrieMatch &m = pending[i].second;
+      for (j=first; j < pool.size(); ++j) {
+        if (pool[j].id == m.id && pool[j].type == m.type)
+          break;
       }
-      child = parent->c;
-    } else {
-      if (parent->a == NULL) {
-        parent->a = ++mem;
+      if (j == pool.size())
+        pool.push_back(m);
+    }
+    node->numMatches = pool.size() - first;
+  }
+
+  // the matches of nodes w/o any matches point at the (harmless) start of the pool
+  if (pool.empty())
+    pool.resize(1);
+  matchPool = &(pool[0]);
+
+  vector< pair<uint32_t, TrieMatch> >().swap(pending);
+}
+
+
+/*
+  Renumbers the nodes so that the ones a search visits most are close together:
+  the top TRIEBFSDEPTH levels are breadth-first (so the root and the levels below it share a few cache lines)
+  and below that, each subtree is depth-first (so a node's child is usually next to it)
+  must be called after pack, and before makeFailureLinks (ie, while the children are the trie's edges)
+ */
+void
+Trie::relayout() {
+
+  unsigned i, j, n = lastNode + 1;
+  uint32_t node, child;
+  vector<uint32_t> order; // the nodes in their new order
+  vector<uint32_t> newIndex(n);
+  vector<uint32_t> stack;
+  vector<unsigned char> depth(n, 0);
+
+  order.reserve(n);
+  order.push_back(TRIEROOT);
+  // breadth-first, while the nodes are shallow
+  for (i=0; i < order.size(); ++i) {
+    node = order[i];
+    if (depth[node] >= TRIEBFSDEPTH)
+      continue;
+    for (j=0; j < 4; ++j) {
+      child = mem[node].child[j];
+      if (child != TRIEROOT) {
+        depth[child] = depth[node] + 1;
+        order.push_back(child);
       }
-      child = parent->a;
     }
-    
-    parent = child;
   }
 
-  if (parent->id == NULL) {
-    parent->id = new vector<unsigned>;
-    parent->type = new vector<unsigned char>;
-    parent->id->push_back(id);
-    parent->type->push_back(type);
-  } else {
-    // ensure that each type/id pair is only added once    
-    for (i=0; i < parent->id->size(); ++i) {
-      if (parent->id->at(i) == id &&
-          parent->type->at(i) == type)
-        return;
+  // and the subtrees below that are depth-first
+  unsigned top = order.size();
+  for (i=0; i < top; ++i) {
+    if (depth[ order[i] ] < TRIEBFSDEPTH)
+      continue;
+    for (j=4; j-- > 0; ) // (pushed in reverse so A is visited first)
+      if (mem[ order[i] ].child[j] != TRIEROOT)
+        stack.push_back(mem[ order[i] ].child[j]);
+    while (! stack.empty()) {
+      node = stack.back();
+      stack.pop_back();
+      order.push_back(node);
+      for (j=4; j-- > 0; )
+        if (mem[node].child[j] != TRIEROOT)
+          stack.push_back(mem[node].child[j]);
     }
+  }
 
-    parent->id->push_back(id);
-    parent->type->push_back(type);    
+  for (i=0; i < n; ++i)
+    newIndex[ order[i] ] = i;
 
+  TrieNode *nodes = (TrieNode*) malloc((size_t)n * sizeof(TrieNode));
+  for (i=0; i < n; ++i) {
+    nodes[i] = mem[ order[i] ];
+    for (j=0; j < 4; ++j)
+      if (nodes[i].child[j] != TRIEROOT)
+        nodes[i].child[j] = newIndex[ nodes[i].child[j] ];
   }
 
-
-  
+  free(mem);
+  mem = nodes;
+  numNodes = n;
 }
 
 
 Trie::~Trie() {
-  unsigned i;
-  TrieNode *n = root;
-  for (i=0; i < numNodes; ++i, ++n) {
-    if ((*n).id != NULL) {
-      delete((*n).id);
-      delete((*n).type);
-    }
-  }
-
-  delete [] root;
+  freeMem();
 }
 
 
@@ -428,15 +663,15 @@ Trie::addPermutations(string w, unsigned wordLen, unsigned id, unsigned char typ
 
 unsigned 
 Trie::nodesUsed() {
-  return mem - root;
+  return lastNode;
 }
 
 
 
 
 void
-Trie::makeTrieFromConfig(vector<Config> *c, unsigned numStrs, unsigned char distance, unsigned char motifDistance) {
-  unsigned i, nf, nr, memNeeded=0;
+Trie::makeTrieFromConfig(vector<Config> *c, unsigned numStrs, unsigned char distance, unsigned char motifDistance, bool motifs) {
+  unsigned i;
 
   if (distance >2) {
     cerr << "Sorry, the max anchor distance supported with trie-search is 2; " << distance   << " is too big!" << endl;
@@ -467,35 +702,15 @@ Trie::makeTrieFromConfig(vector<Config> *c, unsigned numStrs, unsigned char dist
   IUPAC[ (int)'M'][0] = 'A';
   IUPAC[ (int)'M'][1] = 'C';
 
-  // compute an (upper-bound) on the number of nodes in the trie
+  // the trie grows as words are added, so there's no need to bound the number of nodes up front
+  // but we do need to check the ambiguity codes
   for (i=0; i < numStrs; ++i) {
-    // math for the memory needed for a hamming distance of 1:
-    // N = length of string + 1 (ie, including \0)
-    // entering that string requires at most N nodes.
-    // entering all the 1-base substitutions on that string requires
-    // 3*N for all the substitutions on the 0th positoin
-    // 3*(N-1) for all of the substutitions on the 1st position (previous position 0 is already in the trie)
-    // 3*(N-2) for all of the subs on the second position (previous 2 positions are in the trie) 
-    // ...
-    // 3 
-    // which is equal to:
-    // N + 3N + (3(N)(N-1))/2
-    //memNeeded += (2*c[i].forwardLength + 2) + (3* (c[i].reverseLength+2)* (c[i].reverseLength+3))/2;
-    //memNeeded += (2*c[i].reverseLength + 2) + (3* (c[i].forwardLength+2)* (c[i].forwardLength+3))/2;
-
-    // we have the forwardFlank twice (8N) (+ and - strand)
-    // and again for the reverse flank
-    nf = (8*((*c)[i].forwardLength+1)) + 3* ((*c)[i].forwardLength)*((*c)[i].forwardLength-1);
-    nr = (8*((*c)[i].reverseLength+1)) + 3* ((*c)[i].reverseLength)*((*c)[i].reverseLength-1);
-
 
     const char *s = (*c)[i].forwardFlank.c_str();
     unsigned nfAmbig=0;
-    for (unsigned j = 0; j < (*c)[i].forwardLength; ++j, ++s) { // adjust the memory for IUPAC codes (double the memory for each IUPAC code)
-      if ( IUPAC[(int)*s][0] != 0) {
-        nf = nf + nf;
+    for (unsigned j = 0; j < (*c)[i].forwardLength; ++j, ++s) {
+      if ( IUPAC[(int)*s][0] != 0) 
         ++nfAmbig;
-      }
     }
 
     if (nfAmbig > 1) {
@@ -506,111 +721,115 @@ Trie::makeTrieFromConfig(vector<Config> *c, unsigned numStrs, unsigned char dist
 
     s = (*c)[i].reverseFlank.c_str();
     unsigned nrAmbig=0;
-    for (unsigned j = 0; j < (*c)[i].reverseLength; ++j, ++s) { // adjust the memory for IUPAC codes (double the memory for each IUPAC code)
-      if ( IUPAC[(int)*s][0] != 0) {
-        nr = nr + nr;
+    for (unsigned j = 0; j < (*c)[i].reverseLength; ++j, ++s) {
+      if ( IUPAC[(int)*s][0] != 0) 
         ++nrAmbig;
-      }
     }
 
-
-
     if (nrAmbig > 1) {
       cerr << endl << "At most 1 ambiguity code is supported per anchor." << endl <<
         "Problem with locus: " << (*c)[i].locusName << " Anchor " << (*c)[i].reverseFlank << endl << endl;
       exit(EXIT_FAILURE);
     }
-    
-    if (distance == 0) {
-      memNeeded += ((*c)[i].forwardLength+1)*(2*(nfAmbig+1)) + ((*c)[i].reverseLength+1)*(2*(nrAmbig+1));
-    } else if (distance == 1) {
-      memNeeded += nf + nr;
-    } else if (distance == 2) {
-      // got lazy with this one; wolfram alpha was used to simplify the sum:
-      // sum i=1 to N (i)(i-1)
-      // which is the (worst-case) memory needed to add a word of length N and all 2-permutations of it
-      memNeeded += (nfAmbig*nfAmbig+1)*6*((*c)[i].forwardLength)*((*c)[i].forwardLength+1)*((*c)[i].forwardLength+2);
-      memNeeded += (nrAmbig*nrAmbig+1)*6*((*c)[i].reverseLength)*((*c)[i].reverseLength+1)*((*c)[i].reverseLength-1);
-    }
+  }
 
-    memNeeded += ((*c)[i].motifLength+1) *2; // the motifs are also added
-    if (motifDistance == 1) {
-      memNeeded += (8*((*c)[i].motifLength+1)) + 3* ((*c)[i].motifLength)*((*c)[i].motifLength-1);
-    }
+  // words of up to 32 bases fit in a binaryword; they're collected, sorted and bulk-loaded
+  // otherwise there are two passes; the first only counts the nodes (in the growable arena)
+  // and the second builds the trie in an array of exactly that size
+  bool useBulk = true;
+  vector<TrieWord> words;
+  for (i=0; i < numStrs; ++i) {
+    if ((*c)[i].forwardLength > MAXWORD/2 || (*c)[i].reverseLength > MAXWORD/2 || (*c)[i].motifLength > MAXWORD/2)
+      useBulk = false;
   }
 
-  initMem(memNeeded);
+  for (unsigned pass=0; pass < 2; ++pass) {
+    if (useBulk) {
+      if (pass == 1)
+        break;
+      bulk = &words;
+    } else if (pass == 0)
+      initMem();
+    else
+      initMem(nodesUsed() + 1);
 
-  for (i=0; i < numStrs; ++i) {
+    for (i=0; i < numStrs; ++i) {
 
-    int numAmbig=0;
-    string s =  (*c)[i].forwardFlank;
-    for (unsigned j= 0; j < (*c)[i].forwardLength; ++j) {
-      if ( IUPAC[(int)s.at(j)][0] != 0) {
+      int numAmbig=0;
+      string s =  (*c)[i].forwardFlank;
+      for (unsigned j= 0; j < (*c)[i].forwardLength; ++j) {
+        if ( IUPAC[(int)s.at(j)][0] != 0) {
 
-        int iupac = (int)s.at(j);
+          int iupac = (int)s.at(j);
 
-        s[j] = IUPAC[ iupac ][0]; // overwrite the ambiguity code with the first form, then add to trie
-        addPermutations(s, (*c)[i].forwardLength, i, (unsigned char) FORWARDFLANK,
-                        (unsigned char) FORWARDFLANK_RC, distance);
+          s[j] = IUPAC[ iupac ][0]; // overwrite the ambiguity code with the first form, then add to trie
+          addPermutations(s, (*c)[i].forwardLength, i, (unsigned char) FORWARDFLANK,
+                          (unsigned char) FORWARDFLANK_RC, distance);
         
         
-        s[j] = IUPAC[ iupac ][1]; // overwrite the ambiguity code with the second form, then add to trie
-        addPermutations(s, (*c)[i].forwardLength, i, (unsigned char) FORWARDFLANK,
-                        (unsigned char) FORWARDFLANK_RC, distance);
+          s[j] = IUPAC[ iupac ][1]; // overwrite the ambiguity code with the second form, then add to trie
+          addPermutations(s, (*c)[i].forwardLength, i, (unsigned char) FORWARDFLANK,
+                          (unsigned char) FORWARDFLANK_RC, distance);
         
-        ++numAmbig;
-        break;
+          ++numAmbig;
+          break;
+        }
       }
-    }
     
-    if (numAmbig==0) {
+      if (numAmbig==0) {
 
-      addPermutations((*c)[i].forwardFlank, (*c)[i].forwardLength, i, (unsigned char) FORWARDFLANK,
-                      (unsigned char) FORWARDFLANK_RC, distance);
-    }
-    numAmbig=0;
-    s =  (*c)[i].reverseFlank;
-    for (unsigned j= 0; j < (*c)[i].reverseLength; ++j) {
-      if ( IUPAC[(int)s.at(j)][0] != 0) {
+        addPermutations((*c)[i].forwardFlank, (*c)[i].forwardLength, i, (unsigned char) FORWARDFLANK,
+                        (unsigned char) FORWARDFLANK_RC, distance);
+      }
+      numAmbig=0;
+      s =  (*c)[i].reverseFlank;
+      for (unsigned j= 0; j < (*c)[i].reverseLength; ++j) {
+        if ( IUPAC[(int)s.at(j)][0] != 0) {
 
-        int iupac = (int)s.at(j);
+          int iupac = (int)s.at(j);
 
-        s[j] = IUPAC[ iupac ][0]; // overwrite the ambiguity code with the first form, then add to trie
-        addPermutations(s, (*c)[i].reverseLength, i, (unsigned char) REVERSEFLANK, 
-                        (unsigned char) REVERSEFLANK_RC, distance);
+          s[j] = IUPAC[ iupac ][0]; // overwrite the ambiguity code with the first form, then add to trie
+          addPermutations(s, (*c)[i].reverseLength, i, (unsigned char) REVERSEFLANK, 
+                          (unsigned char) REVERSEFLANK_RC, distance);
         
-        s[j] = IUPAC[ iupac ][1]; // overwrite the ambiguity code with the second form, then add to trie
-        addPermutations(s, (*c)[i].reverseLength, i, (unsigned char) REVERSEFLANK, 
-                        (unsigned char) REVERSEFLANK_RC, distance);
+          s[j] = IUPAC[ iupac ][1]; // overwrite the ambiguity code with the second form, then add to trie
+          addPermutations(s, (*c)[i].reverseLength, i, (unsigned char) REVERSEFLANK, 
+                          (unsigned char) REVERSEFLANK_RC, distance);
         
-        ++numAmbig;
-        break;
+          ++numAmbig;
+          break;
+        }
       }
-    }
 
 
-    // and the reverse flank (and its RC)
-    if (numAmbig==0)
-      addPermutations((*c)[i].reverseFlank, (*c)[i].reverseLength, i, (unsigned char) REVERSEFLANK, 
-                      (unsigned char) REVERSEFLANK_RC, distance);
+      // and the reverse flank (and its RC)
+      if (numAmbig==0)
+        addPermutations((*c)[i].reverseFlank, (*c)[i].reverseLength, i, (unsigned char) REVERSEFLANK, 
+                        (unsigned char) REVERSEFLANK_RC, distance);
     
-    if (motifDistance==0) {
-    // add the motif (no degeneracy in this)
-      addWord((*c)[i].strMotif.c_str(), (*c)[i].motifLength, i, MOTIF);
-      addWordRC((*c)[i].strMotif.c_str(), (*c)[i].motifLength, i, MOTIF_RC);
-    } else {
-      addPermutations((*c)[i].strMotif, (*c)[i].motifLength, i, (unsigned char) MOTIF, (unsigned char) MOTIF_RC, motifDistance);
+      if (! motifs)
+        continue;
+
+      if (motifDistance==0) {
+      // add the motif (no degeneracy in this)
+        addWord((*c)[i].strMotif.c_str(), (*c)[i].motifLength, i, MOTIF);
+        addWordRC((*c)[i].strMotif.c_str(), (*c)[i].motifLength, i, MOTIF_RC);
+      } else {
+        addPermutations((*c)[i].strMotif, (*c)[i].motifLength, i, (unsigned char) MOTIF, (unsigned char) MOTIF_RC, motifDistance);
+      }
     }
-  } 
-  
-  //  cerr << memNeeded << " bytes asked for ; Mem unused: " << memNeeded - (mem-root) << endl;
+  }
 
-  if (mem-root > (int) memNeeded) {
-    cerr << "Error with the maths. Email the author (August) to fix this!" << endl;
-    exit(1);
+  if (useBulk) {
+    bulk = NULL;
+    bulkLoad(words);
+    vector<TrieWord>().swap(words);
   }
   
+  pack();
+  relayout();
+  makeFailureLinks();
+  
 }
 
 
@@ -624,8 +843,6 @@ main(int argc, char**argv) {
   char word[] = "AAAAAA";
   char word2[] = "AATTT";
   unsigned len = 5;
-  unsigned foundId[len+1];
-  unsigned char foundType[len+1];
 
   Trie trie;
   trie.initMem(100);
@@ -643,11 +860,6 @@ main(int argc, char**argv) {
   for (unsigned i=3; i <= len; ++i)
     trie.addWord(word2, i, i, 0);
 
-  unsigned numFound = trie.findPrefixMatch(word, len, foundId, foundType);
-  cout << numFound << " matches found\n";
-
-  numFound = trie.findPrefixMatch(word2, len, foundId, foundType);
-  cout << numFound << " OTHER matches found\n";
   
 
   unsigned numStrs=0;
@@ -23,38 +23,90 @@ SOFTWARE.
 */
 
 #ifndef TRIE_H_
+#define TRIE_H_
 
 #include <limits.h>
 #include <vector>
 #include <string>
 
 #include "constants.h"
+#include "lookup.h"
 
 #define NULLSTR UINT_MAX
 
+// a single anchor/motif match found in a read
+struct TrieHit {
+  unsigned pos; // the offset in the read where the match starts
+  unsigned len; // the length of the match
+  unsigned id; // the index of the str in *config
+  unsigned char type; // the type of the anchor (or motif)
+};
+
+// the nodes are kept in one array and refer to each other by index
+// the root is node 0. it is never anyone's child, so a child index of 0 means there's no child
+#define TRIEROOT 0
+
+// the levels of the trie (from the root) that are laid out breadth-first (see relayout)
+#define TRIEBFSDEPTH 10
+
+// the number of reads that the (batched) search works on at once
+#define TRIECURSORS 8
+
+// while the trie is being built, nodes are allocated this many at a time
+#define TRIECHUNKBITS 16
+#define TRIECHUNK (1U << TRIECHUNKBITS)
+
+// an anchor (or motif) that ends at a node
+struct TrieMatch {
+  unsigned id; // the index of the str in *config
+  unsigned char type; // the type of the anchor (forward, reverse, reverse reverse-complemented ,...)
+};
+
+// a word (anchor or motif) waiting to be bulk-loaded into the trie
+struct TrieWord {
+  binaryword w; // the word in its 2-bit encoding (see lookup.cpp); at most 32 bases
+  unsigned seq; // the order the word was added in
+  unsigned id; // the index of the str in *config
+  unsigned char len; // the length of the word
+  unsigned char type; // the type of the anchor/motif
+
+  // lexicographic, and prefixes come before the words they're a prefix of
+  // (equal words are kept in the order they were added)
+  bool operator < (const TrieWord& i) const {
+    if (w != i.w)
+      return w < i.w;
+    if (len != i.len)
+      return len < i.len;
+    return seq < i.seq;
+  }
+};
+
 struct TrieNode {
-  struct TrieNode *a;
-  struct TrieNode *c;
-  struct TrieNode *g;
-  struct TrieNode *t;
-  std::vector<unsigned> *id; // the index of the str in *config
-  std::vector<unsigned char> *type; // the type of the anchor (forward, reverse, reverse reverse-complemented ,...)
+  uint32_t child[4]; // indexed by A, C, G, T. once the failure links are made, these are the transitions of the search (see makeFailureLinks)
+  uint32_t fail; // failure link; the node for the longest proper suffix of this word that is in the trie
+  uint32_t out; // the nearest node along the failure links that has a match (TRIEROOT if there is none)
+  uint32_t matches; // the offset of this node's first match in the match pool
+  unsigned short numMatches; // and how many matches there are
+  unsigned char depth; // the length of the word this node represents
 };
 
 
 class Trie {
  public:
-  TrieNode *root;
 
   Trie();
   ~Trie();
 
-  unsigned findPrefixMatch(const char *w, unsigned wordLen, unsigned *outId, unsigned char *outType);
+  // Aho-Corasick search; reports every anchor/motif in the (encoded) read in one pass
+  // hits are ordered by their start position, and then by length
+  // nothing matches across an ambiguous base (eg, an N)
+  unsigned findAllMatches(const EncodedRead &read, std::vector<TrieHit> &hits);
+  // the same, for numReads reads (the hits of reads[i] are put in hits[i]). the reads are searched together, which hides the latency of the node loads
+  void findAllMatches(const EncodedRead *reads, unsigned numReads, std::vector<TrieHit> *hits);
   // returns a boolean, whether or not the first wordLen characters of *w
   // exist in the trie AND, they MATCH the outId and outType
   bool existsPrefixMatch(const char *w, unsigned wordLen, unsigned outId, unsigned char outType);
-  void initMem(unsigned numNodes); // note the init is done exactly once. you need to precompute how much memory it'll need.
-// an easy upper bound = numLetters in (all anchors) + numAnchors
+  void initMem(unsigned numNodes=0); // empties the trie. numNodes (if known) is the exact size of the trie, otherwise the trie grows as words are added
 
   void addWord(const char *w, unsigned wordLen, unsigned id, unsigned char type);
   // reverse complements the word and adds it
@@ -62,18 +114,54 @@ class Trie {
 
 
   // makes a trie of all of the anchors in the config file, +/- distance substitution (distance can be 0, 1 or 2)
-  // plus it adds the motifs...
-  void makeTrieFromConfig(std::vector<Config> *c, unsigned numStrs, unsigned char distance, unsigned char motifDistance);
+  // plus it adds the motifs... (unless motifs is false)
+  void makeTrieFromConfig(std::vector<Config> *c, unsigned numStrs, unsigned char distance, unsigned char motifDistance, bool motifs=true);
 
   void addPermutations(std::string w, unsigned wordLen, unsigned id, unsigned char type1, unsigned char type2, unsigned char distance);
 
+  // moves the nodes into one (exact-size) array and the matches (from addWord) into the match pool
+  // must be called after the last addWord, and before any of the searches
+  void pack();
+
+  // renumbers the nodes so that they are laid out in the order searches tend to visit them (see trie.cpp)
+  void relayout();
+
+  // computes the failure (and output) links used by findAllMatches. must be called after the last addWord
+  void makeFailureLinks();
+
   unsigned nodesUsed();
 
- protected:
-  TrieNode *mem;
-  unsigned numNodes;
+  // the trie, as pack left it; ie, what a precompiled index needs to save
+  const TrieNode *nodeArray() { return mem; }
+  const TrieMatch *matchArray() { return matchPool; }
+  unsigned matchesUsed() { return pool.size(); }
 
+  // uses nodes/matches from somewhere else (eg, a memory-mapped index); they aren't copied (or freed)
+  void attach(const TrieNode *nodes, unsigned numNodes, const TrieMatch *matches);
 
+ protected:
+  // sorts the (bulk) words, and builds the trie from them in one go
+  void bulkLoad(std::vector<TrieWord> &words);
+
+  bool isChild(const TrieNode *parent, uint32_t child);
+
+  // hands out the next unused node (and returns its index)
+  uint32_t addNode();
+  // the node at index i while the trie is being built
+  TrieNode &node(uint32_t i) { return mem != NULL ? mem[i] : chunks[i >> TRIECHUNKBITS][i & (TRIECHUNK-1)]; }
+  void freeMem();
+
+  TrieNode *mem; // all of the nodes, in one array (set by pack if the trie was grown in chunks)
+  std::vector<TrieNode*> chunks; // the nodes while the trie is being built (w/o a known size)
+  unsigned numNodes; // the size of mem
+  std::vector<TrieWord> *bulk; // when set, addWord/addWordRC append to this (and bulkLoad makes the trie)
+  unsigned lastNode; // the index of the last node handed out; ie, the number of nodes in use (not counting the root)
+
+  bool ownsMem; // false if mem came from attach
+  std::vector<TrieMatch> pool; // the matches of every node, stored contiguously
+  const TrieMatch *matchPool; // == &pool[0] (or the attached matches)
+  // matches are collected here while the trie is being built, as (node, match) pairs
+  std::vector< std::pair<uint32_t, TrieMatch> > pending;
 };
 
 #endif